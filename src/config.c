@@ -39,6 +39,11 @@ channel_conf_t *channels;
 group_conf_t *groups;
 int global_ops[2];
 char *global_sync_state;
+int global_state_format;
+int global_state_log;
+int global_state_fsync;
+char *global_stats_file;
+int global_spill_size;
 
 int
 parse_bool( conffile_t *cfile )
@@ -307,6 +312,12 @@ load_config( const char *where, int pseudo )
 					max_size = parse_size( &cfile );
 				else if (!strcasecmp( "MaxMessages", cfile.cmd ))
 					channel->max_messages = parse_int( &cfile );
+				else if (!strcasecmp( "DetectMoves", cfile.cmd ))
+					channel->detect_moves = parse_bool( &cfile );
+				else if (!strcasecmp( "RecoverUIDValidity", cfile.cmd ))
+					channel->recover_uidval = parse_bool( &cfile );
+				else if (!strcasecmp( "SyncWindow", cfile.cmd ))
+					channel->sync_window = parse_int( &cfile );
 				else if (!strcasecmp( "Pattern", cfile.cmd ) ||
 				         !strcasecmp( "Patterns", cfile.cmd ))
 				{
@@ -398,6 +409,33 @@ load_config( const char *where, int pseudo )
 			}
 			break;
 		}
+		else if (!strcasecmp( "SyncStateFormat", cfile.cmd ))
+		{
+			if (!strcasecmp( "Binary", cfile.val ))
+				global_state_format = STATE_BINARY;
+			else if (!strcasecmp( "Text", cfile.val ))
+				global_state_format = STATE_TEXT;
+			else {
+				error( "%s:%d: invalid SyncStateFormat arg '%s'\n",
+				       cfile.file, cfile.line, cfile.val );
+				err = 1;
+			}
+		}
+		else if (!strcasecmp( "SyncStateLog", cfile.cmd ))
+		{
+			if ((global_state_log = parse_int( &cfile )) < 0) {
+				error( "%s:%d: SyncStateLog must not be negative\n",
+				       cfile.file, cfile.line );
+				global_state_log = 0;
+				err = 1;
+			}
+		}
+		else if (!strcasecmp( "SyncStateFSync", cfile.cmd ))
+			global_state_fsync = parse_bool( &cfile );
+		else if (!strcasecmp( "StatsFile", cfile.cmd ))
+			global_stats_file = expand_strdup( cfile.val );
+		else if (!strcasecmp( "SpillSize", cfile.cmd ))
+			global_spill_size = parse_size( &cfile );
 		else if (!getopt_helper( &cfile, &gcops, global_ops, &global_sync_state ))
 		{
 			error( "%s:%d: unknown section keyword '%s'\n",
@@ -0,0 +1,249 @@
+/*
+ * convbench - measure the line ending conversion done when copying messages
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "isync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* used by util.c */
+const char *Home;
+char *global_stats_file;
+
+/* size of the made-up corpus */
+#define CORPUS_SIZE (32 * 1024 * 1024)
+/* min. time spent on each measurement, in seconds */
+#define MIN_TIME .5
+
+enum { B_MEMCPY, B_COUNT, B_CRA, B_CRA_BACK, B_CRD, B_CRA_BYTES, B_CRD_BYTES, B_NUM };
+
+static const char * const bnames[] = {
+	"memcpy (baseline)",
+	"count LFs",
+	"LF -> CRLF",
+	"LF -> CRLF, in place",
+	"CRLF -> LF",
+	"LF -> CRLF, bytewise",
+	"CRLF -> LF, bytewise",
+};
+
+typedef struct {
+	int off, len, nlf;
+} msg_t;
+
+static char *corpus;
+static int corpus_len;
+static msg_t *msgs;
+static int nmsgs, amsgs;
+
+static void
+add_msg( int len )
+{
+	if (nmsgs == amsgs)
+		msgs = nfrealloc( msgs, (amsgs = amsgs * 2 + 64) * sizeof(msg_t) );
+	msgs[nmsgs].off = corpus_len;
+	msgs[nmsgs].len = len;
+	nmsgs++;
+	corpus_len += len;
+}
+
+/* Each file is one message; CRs are dropped, so files from either kind
+   of store may be used. */
+static void
+read_msg( const char *fn )
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open( fn, O_RDONLY )) < 0 || fstat( fd, &st )) {
+		perror( fn );
+		exit( 1 );
+	}
+	corpus = nfrealloc( corpus, corpus_len + st.st_size );
+	if (read( fd, corpus + corpus_len, st.st_size ) != st.st_size) {
+		perror( fn );
+		exit( 1 );
+	}
+	close( fd );
+	add_msg( conv_copy( corpus + corpus_len, corpus + corpus_len, st.st_size, 0, 1 ) );
+}
+
+/* Make up messages of 1 to 64 kB, with mostly 40 to 76 characters
+   per line, and some empty and some very long lines. */
+static void
+make_msgs( void )
+{
+	char *p;
+	int l, r, ml;
+
+	corpus = nfmalloc( CORPUS_SIZE );
+	for (p = corpus; p < corpus + CORPUS_SIZE; ) {
+		ml = 1024 + (arc4_getbyte() << 8);
+		if (ml > corpus + CORPUS_SIZE - p)
+			ml = corpus + CORPUS_SIZE - p;
+		for (l = 0; l < ml; l += r + 1) {
+			r = arc4_getbyte();
+			r = r < 16 ? 0 : r < 248 ? 40 + r % 37 : 200 + r * 4;
+			if (r >= ml - l)
+				r = ml - l - 1;
+			memset( p + l, 'x', r );
+			p[l + r] = '\n';
+		}
+		add_msg( ml );
+		p += ml;
+	}
+}
+
+/* What msg_fetched() did before conv_copy(). */
+static int
+copy_bytes( char *dst, const char *src, int n, int cra, int crd )
+{
+	char *d = dst;
+	int i;
+	char c;
+
+	for (i = 0; i < n; i++) {
+		c = src[i];
+		if (c == '\r' && crd)
+			continue;
+		if (c == '\n' && cra)
+			*d++ = '\r';
+		*d++ = c;
+	}
+	return d - dst;
+}
+
+static char *crlf;
+static int *crlf_off;
+static volatile int sink;
+
+/* Run one kind of conversion over all messages. */
+static long long
+run_once( int which, char *obuf )
+{
+	msg_t *m;
+	long long bytes = 0;
+	int i, o = 0;
+
+	for (i = 0; i < nmsgs; i++) {
+		m = msgs + i;
+		switch (which) {
+		case B_MEMCPY:
+			memcpy( obuf, corpus + m->off, m->len );
+			break;
+		case B_COUNT:
+			o += count_chr( corpus + m->off, m->len, '\n' );
+			break;
+		case B_CRA:
+			o += conv_copy( obuf, corpus + m->off, m->len, 1, 0 );
+			break;
+		case B_CRA_BACK:
+			memcpy( obuf, corpus + m->off, m->len );
+			conv_copy_back( obuf, 0, m->len, 0, m->nlf );
+			break;
+		case B_CRD:
+			o += conv_copy( obuf, crlf + crlf_off[i], m->len + m->nlf, 0, 1 );
+			break;
+		case B_CRA_BYTES:
+			o += copy_bytes( obuf, corpus + m->off, m->len, 1, 0 );
+			break;
+		case B_CRD_BYTES:
+			o += copy_bytes( obuf, crlf + crlf_off[i], m->len + m->nlf, 0, 1 );
+			break;
+		}
+		bytes += m->len;
+	}
+	sink = o;
+	return bytes;
+}
+
+/* The fast paths must produce exactly what the bytewise one does. */
+static int
+check( char *obuf )
+{
+	msg_t *m;
+	char *lf = crlf + crlf_off[nmsgs - 1] + msgs[nmsgs - 1].len + msgs[nmsgs - 1].nlf;
+	int i, n;
+
+	for (i = 0; i < nmsgs; i++) {
+		m = msgs + i;
+		n = m->len + m->nlf;
+		memcpy( obuf, corpus + m->off, m->len );
+		conv_copy_back( obuf, 0, m->len, 0, m->nlf );
+		if (copy_bytes( lf, corpus + m->off, m->len, 1, 0 ) != n || memcmp( obuf, lf, n ) ||
+		    memcmp( crlf + crlf_off[i], lf, n ) ||
+		    conv_copy( obuf, crlf + crlf_off[i], n, 0, 1 ) != m->len ||
+		    memcmp( obuf, corpus + m->off, m->len ))
+		{
+			fprintf( stderr, "conversion of message %d is wrong\n", i + 1 );
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int
+main( int argc, char **argv )
+{
+	char *obuf;
+	double start, now;
+	long long bytes, total;
+	int i, which, maxlen = 0;
+
+	if (argc > 1 && argv[1][0] == '-') {
+		fputs( "Usage: convbench [message file...]\n"
+		       "Without files, a made-up corpus is used.\n", stderr );
+		return 1;
+	}
+	arc4_init();
+	if (argc > 1)
+		for (i = 1; i < argc; i++)
+			read_msg( argv[i] );
+	else
+		make_msgs();
+	if (!nmsgs)
+		return 0;
+
+	crlf_off = nfmalloc( nmsgs * sizeof(int) );
+	crlf = nfmalloc( corpus_len * 2 + corpus_len * 2 ); /* plus scratch for check() */
+	for (total = i = 0; i < nmsgs; i++) {
+		msgs[i].nlf = count_chr( corpus + msgs[i].off, msgs[i].len, '\n' );
+		crlf_off[i] = total;
+		total += conv_copy( crlf + total, corpus + msgs[i].off, msgs[i].len, 1, 0 );
+		if (maxlen < msgs[i].len + msgs[i].nlf)
+			maxlen = msgs[i].len + msgs[i].nlf;
+	}
+	obuf = nfmalloc( maxlen );
+	if (!check( obuf ))
+		return 1;
+	printf( "%d messages, %d bytes (with LFs only)\n", nmsgs, corpus_len );
+
+	for (which = 0; which < B_NUM; which++) {
+		bytes = 0;
+		start = get_time();
+		do
+			bytes += run_once( which, obuf );
+		while ((now = get_time()) - start < MIN_TIME);
+		printf( "%-24s %7.2f GB/s\n", bnames[which], bytes / (now - start) / 1e9 );
+	}
+	return 0;
+}
@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
@@ -91,10 +92,13 @@ typedef struct _list {
 	struct _list *next, *child;
 	char *val;
 	int len;
+	int size; /* allocated size of a literal's val, 0 otherwise */
+	int fd, tail_len; /* spill file with the rest of a big literal, -1 otherwise */
 } list_t;
 
 typedef struct {
 	int fd;
+	unsigned long rbytes, rmark; /* bytes read, and when the last command completed */
 #if HAVE_LIBSSL
 	SSL *ssl;
 	unsigned int use_ssl:1;
@@ -111,18 +115,27 @@ typedef struct {
 struct imap_cmd;
 #define max_in_progress 50 /* make this configurable? */
 
+/* a message fetch issued ahead of the actual request */
+typedef struct prefetch {
+	struct prefetch *next;
+	struct imap_cmd *cmd; /* while in progress */
+	msg_data_t data;
+	int uid, resp;
+} prefetch_t;
+
 typedef struct imap_store {
 	store_t gen;
 	const char *prefix;
 	unsigned /*currentnc:1,*/ trashnc:1;
-	int uidnext; /* from SELECT responses */
 	unsigned got_namespace:1;
 	list_t *ns_personal, *ns_other, *ns_shared; /* NAMESPACE info */
-	message_t **msgapp; /* FETCH results */
+	message_t **idmsgs; /* messages whose Message-IDs are being loaded */
+	int nidmsgs;
 	unsigned caps, rcaps; /* CAPABILITY results */
 	/* command queue */
 	int nexttag, num_in_progress, literal_pending;
 	struct imap_cmd *in_progress, **in_progress_append;
+	prefetch_t *prefetches;
 #if HAVE_LIBSSL
 	SSL_CTX *SSLContext;
 #endif
@@ -133,6 +146,8 @@ struct imap_cmd {
 	struct imap_cmd *next;
 	char *cmd;
 	int tag;
+	int kind; /* CMD_* */
+	double sent;
 
 	struct {
 		int (*cont)( imap_store_t *ctx, struct imap_cmd *cmd, const char *prompt );
@@ -140,6 +155,7 @@ struct imap_cmd {
 		void *aux;
 		char *data;
 		int data_len;
+		int tail_fd, tail_off, tail_len; /* part of data_len, if nonzero */
 		int uid; /* to identify fetch responses */
 		unsigned
 			create:1, /* create the mailbox if we get an error ... */
@@ -149,6 +165,113 @@ struct imap_cmd {
 
 #define CAP(cap) (ctx->caps & (1 << (cap)))
 
+/* Command statistics for the StatsFile. Latencies from sending a command
+   to its tagged response and the bytes received in the meantime go into
+   histograms with power-of-two buckets. */
+#define CMD_SELECT   0
+#define CMD_LIST     1 /* UID FETCH of message lists */
+#define CMD_BODY     2 /* UID FETCH of message contents */
+#define CMD_APPEND   3
+#define CMD_STORE    4
+#define CMD_COPY     5
+#define CMD_SEARCH   6
+#define CMD_OTHER    7
+#define N_CMD_KINDS  8
+
+#define LAT_BUCKETS  24 /* microseconds; the last one takes all above 8s */
+#define SIZE_BUCKETS 32
+
+static const char *const cmd_kinds[N_CMD_KINDS] = {
+	"select", "list", "body", "append", "store", "copy", "search", "other"
+};
+
+static struct {
+	unsigned count[N_CMD_KINDS];
+	double total[N_CMD_KINDS];
+	unsigned lat[N_CMD_KINDS][LAT_BUCKETS];
+	unsigned size[N_CMD_KINDS][SIZE_BUCKETS];
+	unsigned depth[max_in_progress + 1]; /* commands in flight at submission */
+} cmd_stats;
+
+static int
+log2_bucket( double val, int nbuckets )
+{
+	int b;
+
+	for (b = 0; val >= 2 && b < nbuckets - 1; b++)
+		val /= 2;
+	return b;
+}
+
+static int
+cmd_kind( const char *cmd )
+{
+	if (!strncmp( cmd, "SELECT", 6 ) || !strncmp( cmd, "EXAMINE", 7 ))
+		return CMD_SELECT;
+	if (!strncmp( cmd, "UID FETCH", 9 ))
+		return strstr( cmd, "BODY.PEEK[]" ) ? CMD_BODY : CMD_LIST;
+	if (!strncmp( cmd, "APPEND", 6 ))
+		return CMD_APPEND;
+	if (!strncmp( cmd, "UID STORE", 9 ))
+		return CMD_STORE;
+	if (!strncmp( cmd, "UID COPY", 8 ))
+		return CMD_COPY;
+	if (!strncmp( cmd, "UID SEARCH", 10 ))
+		return CMD_SEARCH;
+	return CMD_OTHER;
+}
+
+static void
+count_cmd( Socket_t *sock, struct imap_cmd *cmd )
+{
+	double us = (get_time() - cmd->sent) * 1e6;
+	unsigned long bytes = sock->rbytes - sock->rmark;
+
+	/* Responses arrive in order, so what came on this connection since
+	   the previous tagged response is attributed to this command. */
+	sock->rmark = sock->rbytes;
+	cmd_stats.count[cmd->kind]++;
+	cmd_stats.total[cmd->kind] += us;
+	cmd_stats.lat[cmd->kind][log2_bucket( us, LAT_BUCKETS )]++;
+	cmd_stats.size[cmd->kind][log2_bucket( bytes, SIZE_BUCKETS )]++;
+}
+
+static int
+format_buckets( char *buf, int bufl, const unsigned *buckets, int nbuckets )
+{
+	int i, bl;
+
+	while (nbuckets && !buckets[nbuckets - 1])
+		nbuckets--;
+	bl = nfsnprintf( buf, bufl, "[" );
+	for (i = 0; i < nbuckets; i++)
+		bl += nfsnprintf( buf + bl, bufl - bl, "%s%u", i ? "," : "", buckets[i] );
+	return bl + nfsnprintf( buf + bl, bufl - bl, "]" );
+}
+
+static void
+dump_cmd_stats( void )
+{
+	int k, bl;
+	char buf[16384];
+
+	for (bl = 0, k = 0; k < N_CMD_KINDS; k++) {
+		if (!cmd_stats.count[k])
+			continue;
+		bl += nfsnprintf( buf + bl, sizeof(buf) - bl, "%s\"%s\":{\"count\":%u,\"mean_us\":%.0f,\"latency_us\":",
+		                  bl ? "," : "", cmd_kinds[k], cmd_stats.count[k], cmd_stats.total[k] / cmd_stats.count[k] );
+		bl += format_buckets( buf + bl, sizeof(buf) - bl, cmd_stats.lat[k], LAT_BUCKETS );
+		bl += nfsnprintf( buf + bl, sizeof(buf) - bl, ",\"bytes\":" );
+		bl += format_buckets( buf + bl, sizeof(buf) - bl, cmd_stats.size[k], SIZE_BUCKETS );
+		bl += nfsnprintf( buf + bl, sizeof(buf) - bl, "}" );
+	}
+	if (!bl)
+		return;
+	bl += nfsnprintf( buf + bl, sizeof(buf) - bl, "},\"depth\":" );
+	format_buckets( buf + bl, sizeof(buf) - bl, cmd_stats.depth, max_in_progress + 1 );
+	stats_record( "{\"type\":\"imap\",\"time\":%ld,\"commands\":{%s}\n", (long)time( 0 ), buf );
+}
+
 enum CAPABILITY {
 	NOLOGIN = 0,
 	UIDPLUS,
@@ -387,7 +510,9 @@ socket_read( Socket_t *sock, char *buf, int len )
 		sock->use_ssl ? SSL_read( sock->ssl, buf, len ) :
 #endif
 		read( sock->fd, buf, len );
-	if (n <= 0) {
+	if (n > 0)
+		sock->rbytes += n;
+	else {
 		socket_perror( "read", sock, n );
 		close( sock->fd );
 		sock->fd = -1;
@@ -486,11 +611,57 @@ new_imap_cmd( void )
 	return cmd;
 }
 
+static void
+free_literal( struct imap_cmd *cmd )
+{
+	free( cmd->param.data );
+	cmd->param.data = 0;
+	if (cmd->param.tail_len) {
+		close( cmd->param.tail_fd );
+		cmd->param.tail_len = 0;
+	}
+}
+
+/* Send the command's literal, streaming the tail of a spilled message
+   from its file. The data is freed in any case. */
+static int
+send_literal( imap_store_t *ctx, struct imap_cmd *cmd )
+{
+	char *buf;
+	int n, ret = -1, off = cmd->param.tail_off, left = cmd->param.tail_len;
+
+	n = cmd->param.data_len - left;
+	if (socket_write( &ctx->buf.sock, cmd->param.data, n ) != n)
+		goto bail;
+	if (left) {
+		buf = nfmalloc( TAIL_CHUNK );
+		for (; left; left -= n, off += n) {
+			if ((n = pread( cmd->param.tail_fd, buf, left < TAIL_CHUNK ? left : TAIL_CHUNK, off )) <= 0) {
+				perror( "IMAP error: cannot read spilled message" );
+				/* the literal cannot be completed, so the connection is unusable */
+				close( ctx->buf.sock.fd );
+				ctx->buf.sock.fd = -1;
+				free( buf );
+				goto bail;
+			}
+			if (socket_write( &ctx->buf.sock, buf, n ) != n) {
+				free( buf );
+				goto bail;
+			}
+		}
+		free( buf );
+	}
+	ret = 0;
+  bail:
+	free_literal( cmd );
+	return ret;
+}
+
 static struct imap_cmd *
 v_submit_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd,
                    const char *fmt, va_list ap )
 {
-	int n, bufl;
+	int bufl;
 	char buf[1024];
 
 	while (ctx->literal_pending)
@@ -511,25 +682,28 @@ v_submit_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd,
 		else
 			printf( ">>> %d LOGIN <user> <pass>\n", cmd->tag );
 	}
+	/* Stamp the command before sending it; with LITERAL+, the upload
+	   of the literal is part of its latency. */
+	if (global_stats_file) {
+		cmd->kind = cmd_kind( cmd->cmd );
+		cmd->sent = get_time();
+	}
 	if (socket_write( &ctx->buf.sock, buf, bufl ) != bufl) {
 		if (cmd->param.data)
-			free( cmd->param.data );
+			free_literal( cmd );
 		free( cmd->cmd );
 		free( cmd );
 		return NULL;
 	}
 	if (cmd->param.data) {
 		if (CAP(LITERALPLUS)) {
-			n = socket_write( &ctx->buf.sock, cmd->param.data, cmd->param.data_len );
-			free( cmd->param.data );
-			if (n != cmd->param.data_len ||
-			    (n = socket_write( &ctx->buf.sock, "\r\n", 2 )) != 2)
+			if (send_literal( ctx, cmd ) ||
+			    socket_write( &ctx->buf.sock, "\r\n", 2 ) != 2)
 			{
 				free( cmd->cmd );
 				free( cmd );
 				return NULL;
 			}
-			cmd->param.data = 0;
 		} else
 			ctx->literal_pending = 1;
 	} else if (cmd->param.cont)
@@ -537,6 +711,8 @@ v_submit_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd,
 	cmd->next = 0;
 	*ctx->in_progress_append = cmd;
 	ctx->in_progress_append = &cmd->next;
+	if (global_stats_file)
+		cmd_stats.depth[ctx->num_in_progress < max_in_progress ? ctx->num_in_progress : max_in_progress]++;
 	ctx->num_in_progress++;
 	return cmd;
 }
@@ -643,10 +819,58 @@ free_list( list_t *list )
 			free_list( list->child );
 		else if (is_atom( list ))
 			free( list->val );
+		if (list->fd >= 0)
+			close( list->fd );
 		free( list );
 	}
 }
 
+/* Write a literal which is too big to be kept in memory to a spill file,
+   and read back only the message header. */
+static int
+spill_literal( imap_store_t *ctx, list_t *cur )
+{
+	msg_data_t head;
+	char *buf;
+	int n, bytes = cur->len;
+
+	if ((cur->fd = spill_file()) < 0)
+		return -1;
+	head.data = 0;
+	buf = nfmalloc( TAIL_CHUNK );
+	/* dump whats left over in the input buffer */
+	n = ctx->buf.bytes - ctx->buf.offset;
+	if (n > bytes)
+		n = bytes;
+	memcpy( buf, ctx->buf.buf + ctx->buf.offset, n );
+	ctx->buf.offset += n;
+	for (;;) {
+		if (write( cur->fd, buf, n ) != n) {
+			perror( "IMAP error: cannot spill message" );
+			goto bail;
+		}
+		if (!(bytes -= n))
+			break;
+		if ((n = socket_read( &ctx->buf.sock, buf, bytes < TAIL_CHUNK ? bytes : TAIL_CHUNK )) <= 0)
+			goto bail;
+	}
+	free( buf );
+	if (lseek( cur->fd, 0, SEEK_SET ) || (n = read_msg_head( cur->fd, &head, cur->len )) < 0) {
+		perror( "IMAP error: cannot read back spilled message" );
+		free( head.data );
+		return -1;
+	}
+	cur->val = head.data;
+	cur->size = head.size;
+	cur->tail_len = cur->len - n;
+	cur->len = n;
+	return 0;
+
+  bail:
+	free( buf );
+	return -1;
+}
+
 static int
 parse_imap_list_l( imap_store_t *ctx, char **sp, list_t **curp, int level )
 {
@@ -664,6 +888,9 @@ parse_imap_list_l( imap_store_t *ctx, char **sp, list_t **curp, int level )
 		*curp = cur = nfmalloc( sizeof(*cur) );
 		curp = &cur->next;
 		cur->val = 0; /* for clean bail */
+		cur->size = 0;
+		cur->fd = -1;
+		cur->tail_len = 0;
 		if (*s == '(') {
 			/* sublist */
 			s++;
@@ -676,7 +903,15 @@ parse_imap_list_l( imap_store_t *ctx, char **sp, list_t **curp, int level )
 			if (*s != '}')
 				goto bail;
 
-			s = cur->val = nfmalloc( cur->len );
+			if (global_spill_size && bytes > global_spill_size) {
+				if (spill_literal( ctx, cur ))
+					goto bail;
+				goto literal_done;
+			}
+
+			/* leave room for the X-TUID & CRs, so the message can be rewritten in place */
+			cur->size = cur->len + DATA_SLACK(cur->len);
+			s = cur->val = nfmalloc( cur->size );
 
 			/* dump whats left over in the input buffer */
 			n = ctx->buf.bytes - ctx->buf.offset;
@@ -700,6 +935,7 @@ parse_imap_list_l( imap_store_t *ctx, char **sp, list_t **curp, int level )
 				bytes -= n;
 			}
 
+		  literal_done:
 			if (buffer_gets( &ctx->buf, &s ))
 				goto bail;
 		} else if (*s == '"') {
@@ -765,11 +1001,11 @@ static int
 parse_fetch( imap_store_t *ctx, char *cmd ) /* move this down */
 {
 	list_t *tmp, *list, *flags;
-	char *body = 0;
+	char *body = 0, *msgid = 0;
 	imap_message_t *cur;
 	msg_data_t *msgdata;
 	struct imap_cmd *cmdp;
-	int uid = 0, mask = 0, status = 0, size = 0;
+	int uid = 0, mask = 0, status = 0, size = 0, bsize = 0, tfd = -1, tlen = 0, lo, hi, mid;
 	unsigned i;
 
 	list = parse_imap_list( ctx, &cmd );
@@ -826,8 +1062,20 @@ parse_fetch( imap_store_t *ctx, char *cmd ) /* move this down */
 					body = tmp->val;
 					tmp->val = 0;       /* don't free together with list */
 					size = tmp->len;
+					bsize = tmp->size;
+					tfd = tmp->fd;
+					tmp->fd = -1;
+					tlen = tmp->tail_len;
 				} else
 					error( "IMAP error: unable to parse BODY[]\n" );
+			} else if (!strcmp( "BODY[HEADER.FIELDS", tmp->val )) {
+				if (is_list( tmp->next ) && is_atom( tmp->next->next ) &&
+				    !strcmp( "]", tmp->next->next->val ) && tmp->next->next->next) {
+					tmp = tmp->next->next->next;
+					if (is_atom( tmp ) && !msgid)
+						msgid = get_msgid( tmp->val, tmp->len );
+				} else
+					error( "IMAP error: unable to parse BODY[HEADER.FIELDS ...]\n" );
 			}
 		}
 	}
@@ -837,25 +1085,42 @@ parse_fetch( imap_store_t *ctx, char *cmd ) /* move this down */
 			if (cmdp->param.uid == uid)
 				goto gotuid;
 		error( "IMAP error: unexpected FETCH response (UID %d)\n", uid );
+		if (tfd >= 0)
+			close( tfd );
 		free_list( list );
 		return -1;
 	  gotuid:
 		msgdata = (msg_data_t *)cmdp->param.aux;
 		msgdata->data = body;
 		msgdata->len = size;
+		msgdata->size = bsize;
+		msgdata->tail_fd = tfd;
+		msgdata->tail_off = size;
+		msgdata->tail_len = tlen;
 		if (status & M_FLAGS)
 			msgdata->flags = mask;
+	} else if (uid && ctx->idmsgs) {
+		for (lo = 0, hi = ctx->nidmsgs; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (ctx->idmsgs[mid]->uid < uid)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < ctx->nidmsgs && ctx->idmsgs[lo]->uid == uid && !ctx->idmsgs[lo]->msgid) {
+			ctx->idmsgs[lo]->msgid = msgid;
+			msgid = 0;
+		}
 	} else if (uid) { /* ignore async flag updates for now */
-		/* XXX this will need sorting for out-of-order (multiple queries) */
-		cur = nfcalloc( sizeof(*cur) );
-		*ctx->msgapp = &cur->gen;
-		ctx->msgapp = &cur->gen.next;
-		cur->gen.next = 0;
+		cur = (imap_message_t *)new_message( &ctx->gen, sizeof(*cur) );
 		cur->gen.uid = uid;
 		cur->gen.flags = mask;
 		cur->gen.status = status;
 		cur->gen.size = size;
+		cur->gen.msgid = msgid;
+		msgid = 0;
 	}
+	free( msgid );
 
 	free_list( list );
 	return 0;
@@ -897,12 +1162,14 @@ parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 			return RESP_BAD;
 		}
 	} else if (!strcmp( "UIDNEXT", arg )) {
-		if (!(arg = next_arg( &s )) || !(ctx->uidnext = atoi( arg ))) {
+		if (!(arg = next_arg( &s )) || !(ctx->gen.uidnext = atoi( arg ))) {
 			error( "IMAP error: malformed NEXTUID status\n" );
 			return RESP_BAD;
 		}
 	} else if (!strcmp( "CAPABILITY", arg )) {
 		parse_capability( ctx, s );
+	} else if (!strcmp( "UIDNOTSTICKY", arg )) {
+		ctx->gen.uidplus = 0;
 	} else if (!strcmp( "ALERT", arg )) {
 		/* RFC2060 says that these messages MUST be displayed
 		 * to the user
@@ -981,7 +1248,7 @@ get_cmd_result( imap_store_t *ctx, struct imap_cmd *tcmd )
 {
 	struct imap_cmd *cmdp, **pcmdp, *ncmdp;
 	char *cmd, *arg, *arg1, *p;
-	int n, resp, resp2, tag;
+	int resp, resp2, tag;
 
 	for (;;) {
 		if (buffer_gets( &ctx->buf, &cmd ))
@@ -1031,10 +1298,7 @@ get_cmd_result( imap_store_t *ctx, struct imap_cmd *tcmd )
 			cmdp = (struct imap_cmd *)((char *)ctx->in_progress_append -
 			       offsetof(struct imap_cmd, next));
 			if (cmdp->param.data) {
-				n = socket_write( &ctx->buf.sock, cmdp->param.data, cmdp->param.data_len );
-				free( cmdp->param.data );
-				cmdp->param.data = 0;
-				if (n != (int)cmdp->param.data_len)
+				if (send_literal( ctx, cmdp ))
 					return RESP_BAD;
 			} else if (cmdp->param.cont) {
 				if (cmdp->param.cont( ctx, cmdp, cmd ))
@@ -1060,6 +1324,13 @@ get_cmd_result( imap_store_t *ctx, struct imap_cmd *tcmd )
 			if (!(*pcmdp = cmdp->next))
 				ctx->in_progress_append = pcmdp;
 			ctx->num_in_progress--;
+			if (global_stats_file) {
+				count_cmd( &ctx->buf.sock, cmdp );
+				if (StatsDump) {
+					StatsDump = 0;
+					dump_cmd_stats();
+				}
+			}
 			if (cmdp->param.cont || cmdp->param.data)
 				ctx->literal_pending = 0;
 			arg = next_arg( &cmd );
@@ -1103,7 +1374,7 @@ get_cmd_result( imap_store_t *ctx, struct imap_cmd *tcmd )
 			if (cmdp->param.done)
 				cmdp->param.done( ctx, cmdp, resp );
 			if (cmdp->param.data)
-				free( cmdp->param.data );
+				free_literal( cmdp );
 			free( cmdp->cmd );
 			free( cmdp );
 			if (!tcmd || tcmd == cmdp)
@@ -1113,12 +1384,42 @@ get_cmd_result( imap_store_t *ctx, struct imap_cmd *tcmd )
 	/* not reached */
 }
 
+static void
+free_prefetches( imap_store_t *ctx )
+{
+	prefetch_t *pf;
+
+	while ((pf = ctx->prefetches)) {
+		ctx->prefetches = pf->next;
+		free( pf->data.data );
+		if (pf->data.tail_fd >= 0)
+			close( pf->data.tail_fd );
+		free( pf );
+	}
+}
+
+/* Collect the results of prefetches which were not claimed. */
+static void
+drain_prefetches( imap_store_t *ctx )
+{
+	prefetch_t *pf;
+
+	for (pf = ctx->prefetches; pf; pf = pf->next)
+		if (pf->cmd) {
+			get_cmd_result( ctx, pf->cmd );
+			if (pf->cmd)
+				return; /* the connection is dead; keep the buffers alive */
+		}
+	free_prefetches( ctx );
+}
+
 static void
 imap_cancel_store( store_t *gctx )
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
 
-	free_generic_messages( gctx->msgs );
+	free_prefetches( ctx );
+	free_generic_messages( gctx );
 	free_string_list( ctx->gen.boxes );
 	if (ctx->buf.sock.fd >= 0)
 		close( ctx->buf.sock.fd );
@@ -1137,8 +1438,7 @@ static store_t *unowned;
 static void
 imap_disown_store( store_t *gctx )
 {
-	free_generic_messages( gctx->msgs );
-	gctx->msgs = 0;
+	free_generic_messages( gctx );
 	gctx->next = unowned;
 	unowned = gctx;
 }
@@ -1151,6 +1451,7 @@ imap_own_store( store_conf_t *conf )
 	for (storep = &unowned; (store = *storep); storep = &store->next)
 		if (store->conf == conf) {
 			*storep = store->next;
+			store->connect_time = store->auth_time = 0;
 			return store;
 		}
 	return 0;
@@ -1166,6 +1467,8 @@ imap_cleanup( void )
 		imap_exec( (imap_store_t *)ctx, 0, "LOGOUT" );
 		imap_cancel_store( ctx );
 	}
+	if (global_stats_file)
+		dump_cmd_stats();
 }
 
 #ifdef HAVE_LIBSSL
@@ -1287,6 +1590,7 @@ imap_open_store( store_conf_t *conf,
 	char *arg, *rsp;
 	struct hostent *he;
 	struct sockaddr_in addr;
+	double start;
 	int s, a[2], preauth;
 #if HAVE_LIBSSL
 	int use_ssl;
@@ -1301,6 +1605,7 @@ imap_open_store( store_conf_t *conf,
 			ctx->gen.boxes = 0;
 			ctx->gen.listed = 0;
 			ctx->gen.conf = conf;
+			ctx->gen.connect_time = ctx->gen.auth_time = 0;
 			goto final;
 		}
 
@@ -1308,6 +1613,7 @@ imap_open_store( store_conf_t *conf,
 	ctx->gen.conf = conf;
 	ctx->buf.sock.fd = -1;
 	ctx->in_progress_append = &ctx->in_progress;
+	start = get_time();
 
 	/* open connection to IMAP server */
 #if HAVE_LIBSSL
@@ -1424,6 +1730,7 @@ imap_open_store( store_conf_t *conf,
 		}
 #endif
 
+		ctx->gen.connect_time = get_time() - start;
 		info ("Logging in...\n");
 		if (!srvc->user) {
 			error( "Skipping account %s, no user\n", srvc->name );
@@ -1474,7 +1781,9 @@ imap_open_store( store_conf_t *conf,
 				goto bail;
 			}
 		}
-	} /* !preauth */
+		ctx->gen.auth_time = get_time() - start - ctx->gen.connect_time;
+	} else
+		ctx->gen.connect_time = get_time() - start;
 
   final:
 	ctx->prefix = "";
@@ -1507,8 +1816,7 @@ imap_open_store( store_conf_t *conf,
 static void
 imap_prepare_paths( store_t *gctx )
 {
-	free_generic_messages( gctx->msgs );
-	gctx->msgs = 0;
+	free_generic_messages( gctx );
 }
 
 static void
@@ -1517,6 +1825,30 @@ imap_prepare_opts( store_t *gctx, int opts )
 	gctx->opts = opts;
 }
 
+/* UID FETCH the given items of a sorted UID set, in chunks of
+   a sane command length. */
+static int
+imap_fetch_set( imap_store_t *ctx, int *uids, int nuids, const char *items )
+{
+	int ret, i, j, bl;
+	char buf[1000];
+
+	for (i = 0; i < nuids; ) {
+		for (bl = 0; i < nuids && bl < 960; i++) {
+			if (bl)
+				buf[bl++] = ',';
+			bl += sprintf( buf + bl, "%d", uids[i] );
+			j = i;
+			for (; i + 1 < nuids && uids[i + 1] == uids[i] + 1; i++);
+			if (i != j)
+				bl += sprintf( buf + bl, ":%d", uids[i] );
+		}
+		if ((ret = imap_exec_b( ctx, 0, "UID FETCH %s (UID%s)", buf, items )) != DRV_OK)
+			return ret;
+	}
+	return DRV_OK;
+}
+
 static int
 imap_select( store_t *gctx, int minuid, int maxuid, int *excs, int nexcs,
              int (*cb)( int sts, void *aux ), void *aux )
@@ -1524,9 +1856,11 @@ imap_select( store_t *gctx, int minuid, int maxuid, int *excs, int nexcs,
 	imap_store_t *ctx = (imap_store_t *)gctx;
 	struct imap_cmd *cmd = new_imap_cmd();
 	const char *prefix;
-	int ret, i, j, bl;
-	char buf[1000];
+	double start;
+	int ret, j;
+	char items[80];
 
+	drain_prefetches( ctx );
 
 	if (!strcmp( gctx->name, "INBOX" )) {
 //		ctx->currentnc = 0;
@@ -1538,36 +1872,32 @@ imap_select( store_t *gctx, int minuid, int maxuid, int *excs, int nexcs,
 
 	cmd->param.create = (gctx->opts & OPEN_CREATE) != 0;
 	cmd->param.trycreate = 1;
-	if ((ret = imap_exec_b( ctx, cmd, "SELECT \"%s%s\"", prefix, gctx->name )) != DRV_OK)
+	gctx->uidnext = 0;
+	gctx->uidplus = CAP(UIDPLUS) != 0; /* cleared by UIDNOTSTICKY */
+	if ((ret = imap_exec_b( ctx, cmd, "%s \"%s%s\"",
+	                        (gctx->opts & OPEN_READONLY) ? "EXAMINE" : "SELECT", prefix, gctx->name )) != DRV_OK)
 		goto bail;
 
+	start = get_time();
 	if (gctx->count) {
-		ctx->msgapp = &gctx->msgs;
-		sort_ints( excs, nexcs );
-		for (i = 0; i < nexcs; ) {
-			for (bl = 0; i < nexcs && bl < 960; i++) {
-				if (bl)
-					buf[bl++] = ',';
-				bl += sprintf( buf + bl, "%d", excs[i] );
-				j = i;
-				for (; i + 1 < nexcs && excs[i + 1] == excs[i] + 1; i++);
-				if (i != j)
-					bl += sprintf( buf + bl, ":%d", excs[i] );
-			}
-			if ((ret = imap_exec_b( ctx, 0, "UID FETCH %s (UID%s%s)", buf,
-			                        (gctx->opts & OPEN_FLAGS) ? " FLAGS" : "",
-			                        (gctx->opts & OPEN_SIZE) ? " RFC822.SIZE" : "" )) != DRV_OK)
-				goto bail;
-		}
 		if (maxuid == INT_MAX)
-			maxuid = ctx->uidnext ? ctx->uidnext - 1 : 1000000000;
+			maxuid = gctx->uidnext ? gctx->uidnext - 1 : 1000000000;
+		/* the listing cannot exceed either the box or the requested range */
+		j = nexcs + (maxuid >= minuid ? maxuid - minuid + 1 : 0);
+		reserve_messages( gctx, sizeof(imap_message_t), j < gctx->count ? j : gctx->count );
+		sort_ints( excs, nexcs );
+		nfsnprintf( items, sizeof(items), "%s%s%s",
+		            (gctx->opts & OPEN_FLAGS) ? " FLAGS" : "",
+		            (gctx->opts & OPEN_SIZE) ? " RFC822.SIZE" : "",
+		            (gctx->opts & OPEN_MSGID) ? " BODY.PEEK[HEADER.FIELDS (MESSAGE-ID)]" : "" );
+		if ((ret = imap_fetch_set( ctx, excs, nexcs, items )) != DRV_OK)
+			goto bail;
 		if (maxuid >= minuid &&
-		    (ret = imap_exec_b( ctx, 0, "UID FETCH %d:%d (UID%s%s)", minuid, maxuid,
-		                        (gctx->opts & OPEN_FLAGS) ? " FLAGS" : "",
-		                        (gctx->opts & OPEN_SIZE) ? " RFC822.SIZE" : "" )) != DRV_OK)
+		    (ret = imap_exec_b( ctx, 0, "UID FETCH %d:%d (UID%s)", minuid, maxuid, items )) != DRV_OK)
 			goto bail;
 	}
 
+	gctx->list_time = get_time() - start;
 	ret = DRV_OK;
 
   bail:
@@ -1576,14 +1906,69 @@ imap_select( store_t *gctx, int minuid, int maxuid, int *excs, int nexcs,
 	return cb( ret, aux );
 }
 
+static void
+prefetch_done( imap_store_t *ctx, struct imap_cmd *cmd, int response )
+{
+	prefetch_t *pf = (prefetch_t *)((char *)cmd->param.aux - offsetof(prefetch_t, data));
+
+	(void)ctx;
+	pf->cmd = 0;
+	pf->resp = response;
+}
+
+static void
+imap_prefetch_msg( store_t *gctx, message_t *msg )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd *cmd = new_imap_cmd();
+	prefetch_t *pf = nfcalloc( sizeof(*pf) );
+
+	pf->uid = msg->uid;
+	pf->data.flags = msg->flags;
+	pf->data.tail_fd = -1;
+	cmd->param.uid = msg->uid;
+	cmd->param.aux = &pf->data;
+	cmd->param.done = prefetch_done;
+	if (!(pf->cmd = submit_imap_cmd( ctx, cmd, "UID FETCH %d (%sBODY.PEEK[])",
+	                                 msg->uid, (msg->status & M_FLAGS) ? "" : "FLAGS " ))) {
+		free( pf );
+		return;
+	}
+	pf->next = ctx->prefetches;
+	ctx->prefetches = pf;
+}
+
 static int
-imap_fetch_msg( store_t *ctx, message_t *msg, msg_data_t *data,
+imap_fetch_msg( store_t *gctx, message_t *msg, msg_data_t *data,
                 int (*cb)( int sts, void *aux ), void *aux )
 {
-	struct imap_cmd *cmd = new_imap_cmd();
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd *cmd;
+	prefetch_t *pf, **pfp;
+	int resp;
+
+	for (pfp = &ctx->prefetches; (pf = *pfp); pfp = &pf->next)
+		if (pf->uid == msg->uid) {
+			if (pf->cmd)
+				get_cmd_result( ctx, pf->cmd );
+			if (pf->cmd) /* still in progress, so the connection is dead */
+				return cb( DRV_STORE_BAD, aux );
+			*pfp = pf->next;
+			data->data = pf->data.data;
+			data->len = pf->data.len;
+			data->size = pf->data.size;
+			data->tail_fd = pf->data.tail_fd;
+			data->tail_off = pf->data.tail_off;
+			data->tail_len = pf->data.tail_len;
+			data->flags = pf->data.flags;
+			resp = pf->resp;
+			free( pf );
+			return cb( resp == RESP_OK ? DRV_OK : resp == RESP_NO ? DRV_MSG_BAD : DRV_STORE_BAD, aux );
+		}
+	cmd = new_imap_cmd();
 	cmd->param.uid = msg->uid;
 	cmd->param.aux = data;
-	return cb( imap_exec_m( (imap_store_t *)ctx, cmd, "UID FETCH %d (%sBODY.PEEK[])",
+	return cb( imap_exec_m( ctx, cmd, "UID FETCH %d (%sBODY.PEEK[])",
 	                        msg->uid, (msg->status & M_FLAGS) ? "" : "FLAGS " ), aux );
 }
 
@@ -1638,10 +2023,15 @@ imap_set_flags( store_t *gctx, message_t *msg, int uid, int add, int del,
 }
 
 static int
-imap_close( store_t *ctx,
+imap_close( store_t *gctx,
             int (*cb)( int sts, void *aux ), void *aux )
 {
-	return cb( imap_exec_b( (imap_store_t *)ctx, 0, "CLOSE" ), aux );
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	int ret;
+
+	ret = imap_exec_b( ctx, 0, "CLOSE" );
+	drain_prefetches( ctx );
+	return cb( ret, aux );
 }
 
 static int
@@ -1655,6 +2045,23 @@ imap_trash_msg( store_t *gctx, message_t *msg,
 	                        msg->uid, ctx->prefix, gctx->conf->trash ), aux );
 }
 
+/* A server-side move would need UIDPLUS to be of any use, so there is
+   no stash; the message is just flagged for deletion. */
+static int
+imap_stash_msg( store_t *gctx, message_t *msg,
+                int (*cb)( int sts, void *aux ), void *aux )
+{
+	return imap_set_flags( gctx, msg, msg->uid, F_DELETED, 0, cb, aux );
+}
+
+static int
+imap_adopt_msg( store_t *gctx, const char *msgid, int size, int crlf, int flags,
+                int (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	(void)gctx; (void)msgid; (void)size; (void)crlf; (void)flags;
+	return cb( DRV_MSG_BAD, 0, aux );
+}
+
 static int
 imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
                 int (*cb)( int sts, int uid, void *aux ), void *aux )
@@ -1672,8 +2079,14 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
 	}
 	flagstr[d] = 0;
 
-	cmd->param.data_len = data->len;
+	cmd->param.data_len = data->len + data->tail_len;
 	cmd->param.data = data->data;
+	if (data->tail_len) {
+		cmd->param.tail_fd = data->tail_fd;
+		cmd->param.tail_off = data->tail_off;
+		cmd->param.tail_len = data->tail_len;
+	} else if (data->tail_fd >= 0)
+		close( data->tail_fd );
 	cmd->param.aux = &uid;
 	uid = -2;
 
@@ -1698,11 +2111,32 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
 		ctx->trashnc = 0;
 	else {
 		/*ctx->currentnc = 0;*/
+		/* Do not rely on APPENDUID any more if the server omits it. */
+		if (uid == -2)
+			gctx->uidplus = 0;
 	}
 
 	return cb( DRV_OK, uid, aux );
 }
 
+static int
+imap_load_msgids( store_t *gctx, message_t **msgs, int nmsgs,
+                  int (*cb)( int sts, void *aux ), void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	int *uids, i, ret;
+
+	uids = nfmalloc( nmsgs * sizeof(int) );
+	for (i = 0; i < nmsgs; i++)
+		uids[i] = msgs[i]->uid;
+	ctx->idmsgs = msgs;
+	ctx->nidmsgs = nmsgs;
+	ret = imap_fetch_set( ctx, uids, nmsgs, " BODY.PEEK[HEADER.FIELDS (MESSAGE-ID)]" );
+	ctx->idmsgs = 0;
+	free( uids );
+	return cb( ret, aux );
+}
+
 static int
 imap_find_msg( store_t *gctx, const char *tuid,
                int (*cb)( int sts, int uid, void *aux ), void *aux )
@@ -1740,10 +2174,11 @@ imap_cancel( store_t *gctx,
 	cb( DRV_OK, aux );
 }
 
-static void
+static int
 imap_commit( store_t *gctx )
 {
 	(void)gctx;
+	return DRV_OK;
 }
 
 imap_server_conf_t *servers, **serverapp = &servers;
@@ -1891,10 +2326,14 @@ struct driver imap_driver = {
 	imap_prepare_opts,
 	imap_select,
 	imap_fetch_msg,
+	imap_prefetch_msg,
 	imap_store_msg,
 	imap_find_msg,
+	imap_load_msgids,
 	imap_set_flags,
 	imap_trash_msg,
+	imap_stash_msg,
+	imap_adopt_msg,
 	imap_close,
 	imap_cancel,
 	imap_commit,
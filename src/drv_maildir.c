@@ -35,8 +35,15 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
 #include <errno.h>
 #include <time.h>
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
 
 #define USE_DB 1
 #ifdef __linux__
@@ -97,12 +104,24 @@ static void decode_maildir_box(const char* in, char* out, size_t size)
 	*out = 0;
 }
 
+#define FSYNC_NONE     0
+#define FSYNC_MESSAGE  1
+#define FSYNC_BATCH    2
+
+/* max. number of stored messages with outstanding fsync() in batch mode */
+#define MAX_SYNC_FDS 100
+
+/* UIDs allocated at once for OPEN_BULK stores */
+#define UID_BATCH 256
+
 typedef struct maildir_store_conf {
 	store_conf_t gen;
 	char *inbox;
 #ifdef USE_DB
 	int alt_map;
 #endif /* USE_DB */
+	int fsync;
+	int watch;
 } maildir_store_conf_t;
 
 typedef struct maildir_message {
@@ -111,10 +130,29 @@ typedef struct maildir_message {
 	char tuid[TUIDL];
 } maildir_message_t;
 
+/* A message taken out of its box by stash_msg(), still lying in its file. */
+typedef struct maildir_stash {
+	struct maildir_stash *next;
+	char *msgid;
+	char *path; /* the box, the subdir and the file name */
+	int blen; /* length of the box part of path */
+	int size, lines; /* not counting an X-TUID header */
+} maildir_stash_t;
+
 typedef struct maildir_store {
 	store_t gen;
 	int uvfd, uvok, nuid;
+	int resv_uid; /* UIDs up to this one are reserved for OPEN_BULK stores */
 	int minuid, maxuid, nexcs, *excs;
+	int *sync_fds, nsync_fds; /* written, but not yet fsync()ed messages */
+	unsigned sync_dirs; /* directories with not yet fsync()ed entries */
+	int sync_uv; /* UIDVALIDITY written, but not yet fsync()ed */
+	maildir_message_t **index; /* open hash of msgs by unique name; built on demand */
+	int index_size;
+	int dfds[6]; /* cur/new/tmp of the box, then of the trash; -1 if not open */
+	int wfd, wds[2]; /* inotify instance and its watches on cur/ and new/ */
+	int changed; /* somebody else modified the box while it was open */
+	maildir_stash_t *stash;
 #ifdef USE_DB
 	DB *db;
 #endif /* USE_DB */
@@ -149,6 +187,7 @@ maildir_open_store( store_conf_t *conf,
                     void (*cb)( store_t *ctx, void *aux ), void *aux )
 {
 	maildir_store_t *ctx;
+	int i;
 	struct stat st;
 
 	if (stat( conf->path, &st ) || !S_ISDIR(st.st_mode)) {
@@ -159,27 +198,51 @@ maildir_open_store( store_conf_t *conf,
 	ctx = nfcalloc( sizeof(*ctx) );
 	ctx->gen.conf = conf;
 	ctx->uvfd = -1;
+	ctx->wfd = -1;
+	for (i = 0; i < 6; i++)
+		ctx->dfds[i] = -1;
 	cb( &ctx->gen, aux );
 }
 
 static void
-free_maildir_messages( message_t *msg )
+free_maildir_messages( store_t *gctx )
 {
-	message_t *tmsg;
+	msg_block_t *blk;
+	int i;
 
-	for (; (tmsg = msg); msg = tmsg) {
-		tmsg = msg->next;
-		free( ((maildir_message_t *)msg)->base );
-		free( msg );
-	}
+	for (blk = gctx->msgblocks; blk; blk = blk->next)
+		for (i = 0; i < blk->used; i++)
+			free( ((maildir_message_t *)block_msg( blk, i ))->base );
+	free_generic_messages( gctx );
 }
 
+static int maildir_sync_pending( maildir_store_t *ctx );
+static void maildir_drain( maildir_store_t *ctx );
+static int maildir_refind_stash( maildir_stash_t *st );
+
 static void
 maildir_cleanup( store_t *gctx )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	int i;
 
-	free_maildir_messages( gctx->msgs );
+	maildir_sync_pending( ctx );
+	if (ctx->wfd >= 0) {
+		maildir_drain( ctx );
+		if (ctx->changed)
+			info( "Maildir notice: %s was modified during the sync; not all changes may have been propagated.\n", gctx->path );
+		close( ctx->wfd );
+		ctx->wfd = -1;
+	}
+	ctx->changed = 0;
+	for (i = 0; i < 6; i++)
+		if (ctx->dfds[i] >= 0) {
+			close( ctx->dfds[i] );
+			ctx->dfds[i] = -1;
+		}
+	free( ctx->index );
+	ctx->index = 0;
+	free_maildir_messages( gctx );
 #ifdef USE_DB
 	if (ctx->db)
 		ctx->db->close( ctx->db, 0 );
@@ -195,7 +258,25 @@ maildir_cleanup( store_t *gctx )
 static void
 maildir_disown_store( store_t *gctx )
 {
+	maildir_stash_t *st;
+
 	maildir_cleanup( gctx );
+	while ((st = ((maildir_store_t *)gctx)->stash)) {
+		((maildir_store_t *)gctx)->stash = st->next;
+		/* nobody claimed it, so it is really deleted now */
+		while (unlink( st->path )) {
+			if (errno != ENOENT) {
+				perror( st->path );
+				break;
+			}
+			if (!maildir_refind_stash( st ))
+				break;
+		}
+		free( st->msgid );
+		free( st->path );
+		free( st );
+	}
+	free( ((maildir_store_t *)gctx)->sync_fds );
 	free_string_list( gctx->boxes );
 	free( gctx );
 }
@@ -212,45 +293,268 @@ maildir_cleanup_drv( void )
 {
 }
 
+static const char *subdirs[] = { "cur", "new", "tmp" };
+
+/* Max. nesting depth of mailbox directories. */
+#define MAX_LIST_DEPTH 32
+
+/* The box name of a path relative to Path: the components of nested
+ * directories are separated by slashes as well. */
 static void
-maildir_list( store_t *gctx,
-              void (*cb)( int sts, void *aux ), void *aux )
+maildir_box_name( const char *path, char *box, int size )
+{
+	const char *p;
+	int bl;
+
+	for (bl = 0; (p = strchr( path, '/' )); path = p + 1) {
+		if (p - path >= size - bl)
+			oob();
+		memcpy( box + bl, path, p - path );
+		box[bl + (p - path)] = 0;
+		decode_maildir_box( box + bl, box + bl, size - bl );
+		bl += strlen( box + bl );
+		box[bl++] = '/';
+	}
+	decode_maildir_box( path, box + bl, size - bl );
+}
+
+/* Find the directory of a box below root and store its path in buf.
+ * A flat ~- encoded directory takes precedence; otherwise, the box is
+ * looked up in the directory of its parent, so nested boxes resolve the
+ * same way whether the store was listed or not. If the box does not
+ * exist, buf receives the directory of its parent, or is empty if that
+ * does not exist either. */
+static int
+maildir_find_box( const char *root, const char *name, char *buf, int bufl )
+{
+	struct stat st;
+	char *nbuf, *e, *comp, ch;
+	int rl, bl;
+
+	nfsnprintf( buf, bufl, "%s", root );
+	rl = strlen( buf );
+	nbuf = nfstrdup( name );
+	/* The longest prefix of the name which exists as a flat directory ... */
+	for (e = nbuf + strlen( nbuf ); ; ) {
+		ch = *e;
+		*e = 0;
+		encode_maildir_box( nbuf, buf + rl, bufl - rl );
+		*e = ch;
+		if (!stat( buf, &st ) && S_ISDIR(st.st_mode))
+			break;
+		while (e > nbuf && *--e != '/')
+			;
+		if (e == nbuf) {
+			free( nbuf );
+			*buf = 0;
+			return 0;
+		}
+	}
+	/* ... holds the remaining components as nested directories. */
+	while (*e) {
+		comp = e + 1;
+		if (!(e = strchr( comp, '/' )))
+			e = comp + strlen( comp );
+		bl = strlen( buf );
+		if (bl + 2 > bufl)
+			oob();
+		buf[bl] = '/';
+		ch = *e;
+		*e = 0;
+		encode_maildir_box( comp, buf + bl + 1, bufl - bl - 1 );
+		*e = ch;
+		if (stat( buf, &st ) || !S_ISDIR(st.st_mode)) {
+			buf[*e ? 0 : bl] = 0;
+			free( nbuf );
+			return 0;
+		}
+	}
+	free( nbuf );
+	return 1;
+}
+
+/* Whether new boxes go into the directory rather than next to it: it
+ * is a mere container, or it holds nested boxes already. */
+static int
+maildir_holds_boxes( const char *dir )
+{
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	int ret;
+	char buf[_POSIX_PATH_MAX];
+
+	nfsnprintf( buf, sizeof(buf), "%s/cur", dir );
+	if (stat( buf, &st ))
+		return 1;
+	if (!(d = opendir( dir )))
+		return 0;
+	ret = 0;
+	while ((de = readdir( d ))) {
+		if (*de->d_name == '.' ||
+		    !strcmp( de->d_name, "cur" ) || !strcmp( de->d_name, "new" ) || !strcmp( de->d_name, "tmp" ))
+			continue;
+		nfsnprintf( buf, sizeof(buf), "%s/%s/cur", dir, de->d_name );
+		if (!stat( buf, &st ) && S_ISDIR(st.st_mode)) {
+			ret = 1;
+			break;
+		}
+	}
+	closedir( d );
+	return ret;
+}
+
+/* Each directory holding cur/, new/ and tmp/ is a box; directories are
+ * descended into regardless, except for the box' own subdirectories. */
+static void
+maildir_list_dir( maildir_store_t *ctx, int dfd, char *path, int pl, int isbox, int depth )
 {
 	DIR *dir;
 	struct dirent *de;
+	const char *inbox = ((maildir_store_conf_t *)ctx->gen.conf)->inbox;
+	int cfd, i, nl, cpl;
+	struct stat st;
+	char box[_POSIX_PATH_MAX], buf[_POSIX_PATH_MAX], fbuf[_POSIX_PATH_MAX];
 
-	if (!(dir = opendir( gctx->conf->path ))) {
-		error( "%s: %s\n", gctx->conf->path, strerror(errno) );
-		cb( DRV_STORE_BAD, aux );
+	if (!(dir = fdopendir( dfd ))) {
+		close( dfd );
 		return;
 	}
 	while ((de = readdir( dir ))) {
-		const char *inbox = ((maildir_store_conf_t *)gctx->conf)->inbox;
-		int bl;
-		struct stat st;
-		char buf[PATH_MAX], box[PATH_MAX];
-
 		if (*de->d_name == '.')
 			continue;
-		bl = nfsnprintf( buf, sizeof(buf), "%s%s/cur", gctx->conf->path, de->d_name );
-		if (stat( buf, &st ) || !S_ISDIR(st.st_mode))
+		if (de->d_type != DT_DIR && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+			continue;
+		if (isbox && (!strcmp( de->d_name, "cur" ) || !strcmp( de->d_name, "new" ) || !strcmp( de->d_name, "tmp" )))
 			continue;
+		if ((cfd = openat( dirfd( dir ), de->d_name, O_RDONLY | O_DIRECTORY )) < 0)
+			continue;
+		for (i = 0; i < 3; i++)
+			if (fstatat( cfd, subdirs[i], &st, 0 ) || !S_ISDIR(st.st_mode))
+				break;
+		nl = strlen( de->d_name );
+		if (pl + nl + 2 > _POSIX_PATH_MAX)
+			oob();
+		memcpy( path + pl, de->d_name, nl + 1 );
+		cpl = pl + nl;
+		if (i == 3) {
+			maildir_box_name( path, box, sizeof(box) );
+			nfsnprintf( buf, sizeof(buf), "%s%s", ctx->gen.conf->path, path );
+			if (!strcmp( buf, inbox ))
+				add_string_list( &ctx->gen.boxes, "INBOX" );
+			else if (!depth)
+				add_string_list( &ctx->gen.boxes, box );
+			else if (maildir_find_box( ctx->gen.conf->path, box, fbuf, sizeof(fbuf) ) && !strcmp( fbuf, buf ))
+				/* Otherwise, a flat directory of the same name shadows it. */
+				add_string_list( &ctx->gen.boxes, box );
+		}
+		/* Symlinks are not followed when descending, as they might form loops. */
+		if (depth < MAX_LIST_DEPTH &&
+		    (de->d_type == DT_DIR ||
+		     (de->d_type == DT_UNKNOWN && !fstatat( dirfd( dir ), de->d_name, &st, AT_SYMLINK_NOFOLLOW ) && S_ISDIR(st.st_mode)))) {
+			path[cpl] = '/';
+			path[cpl + 1] = 0;
+			maildir_list_dir( ctx, cfd, path, cpl + 1, i == 3, depth + 1 );
+		} else
+			close( cfd );
+		path[pl] = 0;
+	}
+	closedir( dir );
+}
+
+static void
+maildir_list( store_t *gctx,
+              void (*cb)( int sts, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	int fd;
+	char path[_POSIX_PATH_MAX];
 
-		decode_maildir_box(de->d_name, box, PATH_MAX);
-		add_string_list( &gctx->boxes,
-		                 !memcmp( buf, inbox, bl - 4 ) && !inbox[bl - 4] ? "INBOX" : box );
+	if ((fd = open( gctx->conf->path, O_RDONLY | O_DIRECTORY )) < 0) {
+		error( "%s: %s\n", gctx->conf->path, strerror(errno) );
+		cb( DRV_STORE_BAD, aux );
+		return;
 	}
-	closedir (dir);
+	path[0] = 0;
+	maildir_list_dir( ctx, fd, path, 0, 0, 0 );
 	gctx->listed = 1;
 
 	cb( DRV_OK, aux );
 }
 
-static const char *subdirs[] = { "cur", "new", "tmp" };
+/* Directory i is the box' cur/, new/ or tmp/, or, plus 3, the trash' one.
+ * The full path is needed only for messages. */
+static const char *
+maildir_path( maildir_store_t *ctx, int i, const char *name, char *buf, int bufl )
+{
+	if (i < 3)
+		nfsnprintf( buf, bufl, "%s/%s/%s", ctx->gen.path, subdirs[i], name );
+	else
+		nfsnprintf( buf, bufl, "%s%s/%s/%s", ctx->gen.conf->path, ctx->gen.conf->trash, subdirs[i - 3], name );
+	return buf;
+}
+
+static void
+maildir_perror( maildir_store_t *ctx, int i, const char *name )
+{
+	int err = errno;
+	char buf[_POSIX_PATH_MAX];
+
+	maildir_path( ctx, i, name, buf, sizeof(buf) );
+	errno = err;
+	perror( buf );
+}
+
+static void
+maildir_error( maildir_store_t *ctx, int i, const char *name, const char *msg )
+{
+	char buf[_POSIX_PATH_MAX];
+
+	error( "Maildir error: %s: %s\n", maildir_path( ctx, i, name, buf, sizeof(buf) ), msg );
+}
+
+/* The box' directories are opened when it is selected, the trash' ones
+ * only when needed, as the trash may not exist yet. */
+static int
+maildir_dir_fd( maildir_store_t *ctx, int i )
+{
+	char buf[_POSIX_PATH_MAX];
+
+	if (ctx->dfds[i] < 0)
+		ctx->dfds[i] = open( maildir_path( ctx, i, ".", buf, sizeof(buf) ), O_RDONLY | O_DIRECTORY );
+	return ctx->dfds[i];
+}
+
+static int
+maildir_open_dirs( maildir_store_t *ctx )
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if (maildir_dir_fd( ctx, i ) < 0) {
+			maildir_perror( ctx, i, "." );
+			return DRV_BOX_BAD;
+		}
+	return DRV_OK;
+}
+
+/* Iterate directory i; the returned stream does not disturb the cached descriptor. */
+static DIR *
+maildir_open_dir( maildir_store_t *ctx, int i )
+{
+	DIR *d;
+	int fd;
+
+	if ((fd = openat( ctx->dfds[i], ".", O_RDONLY | O_DIRECTORY )) < 0)
+		return 0;
+	if (!(d = fdopendir( fd )))
+		close( fd );
+	return d;
+}
 
 typedef struct {
-	char *base;
-	int size;
+	char *base, *msgid;
+	int size, lines;
 	unsigned uid:31, recent:1;
 	char tuid[TUIDL];
 } msg_t;
@@ -258,6 +562,7 @@ typedef struct {
 typedef struct {
 	msg_t *ents;
 	int nents, nalloc;
+	int unnumbered; /* messages without UID were left out */
 } msglist_t;
 
 static void
@@ -266,15 +571,18 @@ maildir_free_scan( msglist_t *msglist )
 	int i;
 
 	if (msglist->ents) {
-		for (i = 0; i < msglist->nents; i++)
+		for (i = 0; i < msglist->nents; i++) {
 			if (msglist->ents[i].base)
 				free( msglist->ents[i].base );
+			free( msglist->ents[i].msgid );
+		}
 		free( msglist->ents );
 	}
 }
 
 #define _24_HOURS (3600 * 24)
 
+/* A negative create demands that the box is left alone entirely. */
 static int
 maildir_validate( const char *prefix, const char *box, int create )
 {
@@ -288,7 +596,7 @@ maildir_validate( const char *prefix, const char *box, int create )
 	bl = nfsnprintf( buf, sizeof(buf) - 4, "%s%s/", prefix, box );
 	if (stat( buf, &st )) {
 		if (errno == ENOENT) {
-			if (create) {
+			if (create > 0) {
 				if (mkdir( buf, 0700 )) {
 					error( "Maildir error: mkdir %s: %s (errno %d)\n",
 					       buf, strerror(errno), errno );
@@ -318,12 +626,18 @@ maildir_validate( const char *prefix, const char *box, int create )
 			if (!stat( buf, &st ) && S_ISDIR(st.st_mode))
 				j++;
 		}
-		if (!j)
-			goto mkdirs;
+		if (!j) {
+			if (create >= 0)
+				goto mkdirs;
+			error( "Maildir error: mailbox '%.*s' does not exist\n", bl, buf );
+			return DRV_BOX_BAD;
+		}
 		if (j != 3) {
 			error( "Maildir error: '%.*s' is no valid mailbox\n", bl, buf );
 			return DRV_BOX_BAD;
 		}
+		if (create < 0)
+			return DRV_OK;
 		memcpy( buf + bl, "tmp/", 5 );
 		bl += 4;
 		if (!(dirp = opendir( buf ))) {
@@ -368,6 +682,8 @@ maildir_set_uid( maildir_store_t *ctx, const char *name, int *uid )
 
 	if (uid)
 		*uid = ++ctx->nuid;
+	if (ctx->gen.opts & OPEN_READONLY)
+		return DRV_OK;
 	key.data = (void *)"UIDVALIDITY";
 	key.size = 11;
 	uv[0] = ctx->gen.uidvalidity;
@@ -403,12 +719,26 @@ maildir_store_uid( maildir_store_t *ctx )
 	int n;
 	char buf[128];
 
+	if (ctx->gen.opts & OPEN_READONLY)
+		return DRV_OK;
 	n = sprintf( buf, "%d\n%d\n", ctx->gen.uidvalidity, ctx->nuid );
 	lseek( ctx->uvfd, 0, SEEK_SET );
 	if (write( ctx->uvfd, buf, n ) != n || ftruncate( ctx->uvfd, n )) {
 		error( "Maildir error: cannot write UIDVALIDITY.\n" );
 		return DRV_BOX_BAD;
 	}
+	/* The counter must not fall behind UIDs which made it to disk. */
+	switch (((maildir_store_conf_t *)ctx->gen.conf)->fsync) {
+	case FSYNC_MESSAGE:
+		if (fsync( ctx->uvfd )) {
+			error( "Maildir error: cannot fsync UIDVALIDITY.\n" );
+			return DRV_BOX_BAD;
+		}
+		break;
+	case FSYNC_BATCH:
+		ctx->sync_uv = 1;
+		break;
+	}
 	return DRV_OK;
 }
 
@@ -422,6 +752,8 @@ maildir_init_uid( maildir_store_t *ctx, const char *msg )
 #ifdef USE_DB
 	if (ctx->db) {
 		u_int32_t count;
+		if (ctx->gen.opts & OPEN_READONLY)
+			return DRV_OK;
 		ctx->db->truncate( ctx->db, 0, &count, 0 );
 		return maildir_set_uid( ctx, 0, 0 );
 	}
@@ -435,6 +767,9 @@ maildir_uidval_lock( maildir_store_t *ctx )
 	int n;
 	char buf[128];
 
+	/* A read-only box may lack the file; its UIDs are made up then. */
+	if (ctx->uvfd < 0)
+		return maildir_init_uid( ctx, 0 );
 #ifdef LEGACY_FLOCK
 	/* This is legacy only */
 	if (flock( ctx->uvfd, LOCK_EX ) < 0) {
@@ -447,7 +782,7 @@ maildir_uidval_lock( maildir_store_t *ctx )
 #if SEEK_SET != 0
 	lck.l_whence = SEEK_SET;
 #endif
-	lck.l_type = F_WRLCK;
+	lck.l_type = (ctx->gen.opts & OPEN_READONLY) ? F_RDLCK : F_WRLCK;
 	if (fcntl( ctx->uvfd, F_SETLKW, &lck )) {
 		error( "Maildir error: cannot fcntl lock UIDVALIDITY.\n" );
 		return DRV_BOX_BAD;
@@ -541,6 +876,21 @@ maildir_compare( const void *l, const void *r )
 	return strcmp( lm->base, rm->base );
 }
 
+/* The size a message file would have with CRLF line endings is its
+   size plus this. */
+static int
+count_lines( int fd )
+{
+	char buf[16384];
+	int n, lines = 0;
+
+	if (lseek( fd, 0, SEEK_SET ))
+		return -1;
+	while ((n = read( fd, buf, sizeof(buf) )) > 0)
+		lines += count_chr( buf, n, '\n' );
+	return n < 0 ? -1 : lines;
+}
+
 static int
 maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 {
@@ -553,7 +903,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 	DBC *dbc;
 #endif /* USE_DB */
 	msg_t *entry;
-	int i, j, uid, bl, fnl, ret;
+	int i, j, l, uid, fd, fnl, ret;
 	struct stat st;
 	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
 
@@ -566,6 +916,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
   again:
 	msglist->ents = 0;
 	msglist->nents = msglist->nalloc = 0;
+	msglist->unnumbered = 0;
 	ctx->gen.count = ctx->gen.recent = 0;
 	if (ctx->uvok || ctx->maxuid == INT_MAX) {
 #ifdef USE_DB
@@ -581,11 +932,9 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 			}
 		}
 #endif /* USE_DB */
-		bl = nfsnprintf( buf, sizeof(buf) - 4, "%s/", ctx->gen.path );
 		for (i = 0; i < 2; i++) {
-			memcpy( buf + bl, subdirs[i], 4 );
-			if (!(d = opendir( buf ))) {
-				perror( buf );
+			if (!(d = maildir_open_dir( ctx, i ))) {
+				maildir_perror( ctx, i, "." );
 #ifdef USE_DB
 				if (!ctx->db)
 #endif /* USE_DB */
@@ -631,25 +980,31 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					if (!uid)
 						uid = INT_MAX;
 				}
-				if (uid <= ctx->maxuid) {
-					if (uid < ctx->minuid) {
-						for (j = 0; j < ctx->nexcs; j++)
-							if (ctx->excs[j] == uid)
-								goto oke;
-						continue;
-					  oke: ;
+				if (uid < ctx->minuid || uid > ctx->maxuid) {
+					/* the exceptions are sorted */
+					for (l = 0, j = ctx->nexcs; l < j; ) {
+						if (ctx->excs[(l + j) / 2] < uid)
+							l = (l + j) / 2 + 1;
+						else
+							j = (l + j) / 2;
 					}
-					if (msglist->nalloc == msglist->nents) {
-						msglist->nalloc = msglist->nalloc * 2 + 100;
-						msglist->ents = nfrealloc( msglist->ents, msglist->nalloc * sizeof(msg_t) );
+					if (l == ctx->nexcs || ctx->excs[l] != uid) {
+						if (uid == INT_MAX)
+							msglist->unnumbered = 1;
+						continue;
 					}
-					entry = &msglist->ents[msglist->nents++];
-					entry->base = nfstrdup( e->d_name );
-					entry->uid = uid;
-					entry->recent = i;
-					entry->size = 0;
-					entry->tuid[0] = 0;
 				}
+				if (msglist->nalloc == msglist->nents) {
+					msglist->nalloc = msglist->nalloc * 2 + 100;
+					msglist->ents = nfrealloc( msglist->ents, msglist->nalloc * sizeof(msg_t) );
+				}
+				entry = &msglist->ents[msglist->nents++];
+				entry->base = nfstrdup( e->d_name );
+				entry->uid = uid;
+				entry->recent = i;
+				entry->size = entry->lines = 0;
+				entry->tuid[0] = 0;
+				entry->msgid = 0;
 			}
 			closedir( d );
 		}
@@ -694,8 +1049,6 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					goto again;
 				}
 				uid = entry->uid;
-				if (ctx->gen.opts & (OPEN_SIZE|OPEN_FIND))
-					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
 #ifdef USE_DB
 			} else if (ctx->db) {
 				if ((ret = maildir_set_uid( ctx, entry->base, &uid )) != DRV_OK) {
@@ -703,9 +1056,10 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					return ret;
 				}
 				entry->uid = uid;
-				if (ctx->gen.opts & (OPEN_SIZE|OPEN_FIND))
-					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
 #endif /* USE_DB */
+			} else if (ctx->gen.opts & OPEN_READONLY) {
+				/* Without renaming, the UID is valid for this run only. */
+				entry->uid = uid = ++ctx->nuid;
 			} else {
 				if ((ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK) {
 					maildir_free_scan( msglist );
@@ -717,15 +1071,13 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 				else
 					u = ru = strchr( entry->base, ':' );
 				fnl = (u ?
-					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%.*s,U=%d%s", subdirs[entry->recent], u - entry->base, entry->base, uid, ru ) :
-					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s,U=%d", subdirs[entry->recent], entry->base, uid ))
-					+ 1 - 4;
-				memcpy( nbuf, buf, bl + 4 );
-				nfsnprintf( nbuf + bl + 4, sizeof(nbuf) - bl - 4, "%s", entry->base );
-				if (rename( nbuf, buf )) {
+					nfsnprintf( buf, sizeof(buf), "%.*s,U=%d%s", u - entry->base, entry->base, uid, ru ) :
+					nfsnprintf( buf, sizeof(buf), "%s,U=%d", entry->base, uid ))
+					+ 1;
+				if (renameat( ctx->dfds[entry->recent], entry->base, ctx->dfds[entry->recent], buf )) {
 				  notok:
 					if (errno != ENOENT) {
-						perror( buf );
+						maildir_perror( ctx, entry->recent, entry->base );
 						maildir_uidval_unlock( ctx );
 						maildir_free_scan( msglist );
 						return DRV_BOX_BAD;
@@ -735,25 +1087,37 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 				}
 				free( entry->base );
 				entry->base = nfmalloc( fnl );
-				memcpy( entry->base, buf + bl + 4, fnl );
+				memcpy( entry->base, buf, fnl );
 			}
 			if (ctx->gen.opts & OPEN_SIZE) {
-				if (stat( buf, &st ))
+				if (fstatat( ctx->dfds[entry->recent], entry->base, &st, 0 ))
 					goto notok;
 				entry->size = st.st_size;
 			}
-			if (ctx->gen.opts & OPEN_FIND) {
-				if (!(f = fopen( buf, "r" )))
+			if (ctx->gen.opts & (OPEN_FIND|OPEN_MSGID)) {
+				if ((fd = openat( ctx->dfds[entry->recent], entry->base, O_RDONLY )) < 0)
 					goto notok;
+				if (!(f = fdopen( fd, "r" ))) {
+					close( fd );
+					goto notok;
+				}
 				while (fgets( nbuf, sizeof(nbuf), f )) {
 					if (!nbuf[0] || nbuf[0] == '\n')
 						break;
-					if (!memcmp( nbuf, "X-TUID: ", 8 ) && nbuf[8 + TUIDL] == '\n') {
+					if ((ctx->gen.opts & OPEN_FIND) && !memcmp( nbuf, "X-TUID: ", 8 ) && nbuf[8 + TUIDL] == '\n') {
 						memcpy( entry->tuid, nbuf + 8, TUIDL );
+						if (!(ctx->gen.opts & OPEN_MSGID) || entry->msgid)
+							break;
+					} else if ((ctx->gen.opts & OPEN_MSGID) && !entry->msgid &&
+					           (entry->msgid = get_msgid( nbuf, strlen( nbuf ) )) &&
+					           (!(ctx->gen.opts & OPEN_FIND) || entry->tuid[0]))
 						break;
-					}
 				}
+				if ((ctx->gen.opts & OPEN_LINES) && entry->msgid)
+					entry->lines = count_lines( fileno( f ) );
 				fclose( f );
+				if (entry->lines < 0)
+					goto notok;
 			}
 		}
 		ctx->uvok = 1;
@@ -771,6 +1135,9 @@ maildir_init_msg( maildir_store_t *ctx, maildir_message_t *msg, msg_t *entry )
 	msg->base = entry->base;
 	entry->base = 0; /* prevent deletion */
 	msg->gen.size = entry->size;
+	msg->gen.lines = entry->lines;
+	msg->gen.msgid = entry->msgid;
+	entry->msgid = 0;
 	strncpy( msg->tuid, entry->tuid, TUIDL );
 	if (entry->recent)
 		msg->gen.status |= M_RECENT;
@@ -782,14 +1149,10 @@ maildir_init_msg( maildir_store_t *ctx, maildir_message_t *msg, msg_t *entry )
 }
 
 static void
-maildir_app_msg( maildir_store_t *ctx, message_t ***msgapp, msg_t *entry )
+maildir_app_msg( maildir_store_t *ctx, msg_t *entry )
 {
-	maildir_message_t *msg = nfmalloc( sizeof(*msg) );
-	msg->gen.next = **msgapp;
-	**msgapp = &msg->gen;
-	*msgapp = &msg->gen.next;
+	maildir_message_t *msg = (maildir_message_t *)new_message( &ctx->gen, sizeof(*msg) );
 	msg->gen.uid = entry->uid;
-	msg->gen.status = 0;
 	maildir_init_msg( ctx, msg, entry );
 }
 
@@ -797,17 +1160,22 @@ static void
 maildir_prepare_paths( store_t *gctx )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	char buf[_POSIX_PATH_MAX], box[_POSIX_PATH_MAX];
 
 	maildir_cleanup( gctx );
-	gctx->msgs = 0;
 	ctx->uvfd = -1;
 #ifdef USE_DB
 	ctx->db = 0;
 #endif /* USE_DB */
 	if (!strcmp( gctx->name, "INBOX" ))
 		gctx->path = nfstrdup( ((maildir_store_conf_t *)gctx->conf)->inbox );
-	else {
-		char box[_POSIX_PATH_MAX];
+	else if (maildir_find_box( gctx->conf->path, gctx->name, buf, sizeof(buf) ))
+		gctx->path = nfstrdup( buf );
+	else if (*buf && maildir_holds_boxes( buf )) {
+		/* A new box goes next to its nested siblings. */
+		encode_maildir_box(strrchr( gctx->name, '/' ) + 1, box, _POSIX_PATH_MAX);
+		nfasprintf( &gctx->path, "%s/%s", buf, box );
+	} else {
 		encode_maildir_box(gctx->name, box, _POSIX_PATH_MAX);
 		nfasprintf( &gctx->path, "%s%s", gctx->conf->path, box );
 	}
@@ -823,13 +1191,15 @@ maildir_prepare_opts( store_t *gctx, int opts )
 	gctx->opts = opts;
 }
 
+static void maildir_watch( maildir_store_t *ctx );
+
 static int
 maildir_select( store_t *gctx, int minuid, int maxuid, int *excs, int nexcs,
                 int (*cb)( int sts, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	message_t **msgapp;
 	msglist_t msglist;
+	double start;
 	int i;
 #ifdef USE_DB
 	int ret;
@@ -840,13 +1210,20 @@ maildir_select( store_t *gctx, int minuid, int maxuid, int *excs, int nexcs,
 	ctx->maxuid = maxuid;
 	ctx->excs = nfrealloc( excs, nexcs * sizeof(int) );
 	ctx->nexcs = nexcs;
+	sort_ints( ctx->excs, nexcs );
 
-	if (maildir_validate( gctx->path, "", ctx->gen.opts & OPEN_CREATE ) != DRV_OK)
+	if (maildir_validate( gctx->path, "", (ctx->gen.opts & OPEN_READONLY) ? -1 :
+	                                      (ctx->gen.opts & OPEN_CREATE) != 0 ) != DRV_OK ||
+	    maildir_open_dirs( ctx ) != DRV_OK)
 		return cb( DRV_BOX_BAD, aux );
+	/* Start watching before scanning, so no change can slip through. */
+	if (((maildir_store_conf_t *)gctx->conf)->watch)
+		maildir_watch( ctx );
 
 	nfsnprintf( uvpath, sizeof(uvpath), "%s/.uidvalidity", gctx->path );
 #ifndef USE_DB
-	if ((ctx->uvfd = open( uvpath, O_RDWR|O_CREAT, 0600 )) < 0) {
+	if ((ctx->uvfd = open( uvpath, (gctx->opts & OPEN_READONLY) ? O_RDONLY : O_RDWR|O_CREAT, 0600 )) < 0 &&
+	    (!(gctx->opts & OPEN_READONLY) || errno != ENOENT)) {
 		perror( uvpath );
 		return cb( DRV_BOX_BAD, aux );
 	}
@@ -905,12 +1282,18 @@ maildir_select( store_t *gctx, int minuid, int maxuid, int *excs, int nexcs,
   fnok:
 #endif /* USE_DB */
 
+	start = get_time();
 	if (maildir_scan( ctx, &msglist ) != DRV_OK)
 		return cb( DRV_BOX_BAD, aux );
-	msgapp = &ctx->gen.msgs;
+	reserve_messages( gctx, sizeof(maildir_message_t), msglist.nents );
 	for (i = 0; i < msglist.nents; i++)
-		maildir_app_msg( ctx, &msgapp, msglist.ents + i );
+		maildir_app_msg( ctx, msglist.ents + i );
 	maildir_free_scan( &msglist );
+	/* Messages left without UID will get them above the counter. */
+	gctx->uidnext = (ctx->uvok && !msglist.unnumbered) ? ctx->nuid + 1 : 0;
+	gctx->uidplus = 1;
+	ctx->resv_uid = 0;
+	gctx->list_time = get_time() - start;
 
 	return cb( DRV_OK, aux );
 }
@@ -925,6 +1308,8 @@ maildir_rescan( maildir_store_t *ctx )
 
 	if (maildir_scan( ctx, &msglist ) != DRV_OK)
 		return DRV_BOX_BAD;
+	free( ctx->index );
+	ctx->index = 0;
 	ctx->gen.recent = 0;
 	for (msgapp = &ctx->gen.msgs, i = 0;
 	     (msg = (maildir_message_t *)*msgapp) || i < msglist.nents; )
@@ -932,7 +1317,7 @@ maildir_rescan( maildir_store_t *ctx )
 		if (!msg) {
 #if 0
 			debug( "adding new message %d\n", msglist.ents[i].uid );
-			maildir_app_msg( ctx, &msgapp, msglist.ents + i );
+			maildir_app_msg( ctx, msglist.ents + i );
 #else
 			debug( "ignoring new message %d\n", msglist.ents[i].uid );
 #endif
@@ -945,7 +1330,7 @@ maildir_rescan( maildir_store_t *ctx )
 			/* this should not happen, actually */
 #if 0
 			debug( "adding new message %d\n", msglist.ents[i].uid );
-			maildir_app_msg( ctx, &msgapp, msglist.ents + i );
+			maildir_app_msg( ctx, msglist.ents + i );
 #else
 			debug( "ignoring new message %d\n", msglist.ents[i].uid );
 #endif
@@ -958,6 +1343,7 @@ maildir_rescan( maildir_store_t *ctx )
 			debug( "updating message %d\n", msg->gen.uid );
 			msg->gen.status &= ~(M_FLAGS|M_RECENT);
 			free( msg->base );
+			free( msg->gen.msgid );
 			maildir_init_msg( ctx, msg, msglist.ents + i );
 			i++, msgapp = &msg->gen.next;
 		}
@@ -966,15 +1352,260 @@ maildir_rescan( maildir_store_t *ctx )
 	return DRV_OK;
 }
 
+/* The unique part of a message file name is everything before the flags. */
+static int
+maildir_name_len( const char *base )
+{
+	return strcspn( base, ":" );
+}
+
+static unsigned
+maildir_name_hash( const char *base, int len )
+{
+	unsigned h = 0;
+
+	while (len--)
+		h = h * 31 + (unsigned char)*base++;
+	return h;
+}
+
+static void
+maildir_build_index( maildir_store_t *ctx )
+{
+	message_t *msg;
+	unsigned h;
+	int n, sz;
+
+	for (n = 0, msg = ctx->gen.msgs; msg; msg = msg->next)
+		n++;
+	for (sz = 64; sz < n * 2; sz *= 2);
+	ctx->index = nfcalloc( sz * sizeof(*ctx->index) );
+	ctx->index_size = sz;
+	for (msg = ctx->gen.msgs; msg; msg = msg->next) {
+		if (msg->status & M_DEAD)
+			continue;
+		h = maildir_name_hash( ((maildir_message_t *)msg)->base, maildir_name_len( ((maildir_message_t *)msg)->base ) );
+		while (ctx->index[h & (sz - 1)])
+			h++;
+		ctx->index[h & (sz - 1)] = (maildir_message_t *)msg;
+	}
+}
+
+static maildir_message_t *
+maildir_index_find( maildir_store_t *ctx, const char *name, int len )
+{
+	maildir_message_t *msg;
+	unsigned h;
+
+	for (h = maildir_name_hash( name, len ); (msg = ctx->index[h & (ctx->index_size - 1)]); h++)
+		if (maildir_name_len( msg->base ) == len && !memcmp( msg->base, name, len ))
+			return msg;
+	return 0;
+}
+
+static void
+maildir_relocated( maildir_store_t *ctx, maildir_message_t *msg, const char *name, int recent )
+{
+	debug( "message %d moved to %s/%s\n", msg->gen.uid, subdirs[recent], name );
+	free( msg->base );
+	msg->base = nfstrdup( name );
+	msg->gen.status &= ~(M_FLAGS|M_RECENT);
+	if (recent)
+		msg->gen.status |= M_RECENT;
+	if (ctx->gen.opts & OPEN_FLAGS) {
+		msg->gen.status |= M_FLAGS;
+		msg->gen.flags = maildir_parse_flags( msg->base );
+	} else
+		msg->gen.flags = 0;
+}
+
+/* Look for a message whose flags were changed behind our back by trying
+ * its unique name with every combination of the flags we know about. */
+static int
+maildir_probe( maildir_store_t *ctx, maildir_message_t *msg )
+{
+	unsigned fl, i;
+	int nl, fe, r;
+	struct stat st;
+	char buf[_POSIX_PATH_MAX];
+
+	nl = maildir_name_len( msg->base );
+	if ((int)sizeof(buf) < nl + 3 + NUM_FLAGS + 1)
+		oob();
+	memcpy( buf, msg->base, nl );
+	for (r = 0; r < 2; r++) {
+		buf[nl] = 0;
+		if (!fstatat( ctx->dfds[r], buf, &st, 0 ))
+			goto found;
+		memcpy( buf + nl, ":2,", 3 );
+		for (fl = 0; fl < 1 << NUM_FLAGS; fl++) {
+			fe = nl + 3;
+			for (i = 0; i < as(Flags); i++)
+				if (fl & (1 << i))
+					buf[fe++] = Flags[i];
+			buf[fe] = 0;
+			if (!fstatat( ctx->dfds[r], buf, &st, 0 ))
+				goto found;
+		}
+	}
+	return 0;
+  found:
+	maildir_relocated( ctx, msg, buf, r );
+	return 1;
+}
+
+/* Catch up with all messages which were renamed behind our back by reading
+ * new/ and cur/ once. Returns -1 on error, otherwise whether msg was seen. */
+static int
+maildir_relocate( maildir_store_t *ctx, maildir_message_t *msg )
+{
+	DIR *d;
+	struct dirent *e;
+	maildir_message_t *imsg;
+	int r, nl, found = 0;
+
+	if (!ctx->index)
+		maildir_build_index( ctx );
+	for (r = 1; r >= 0; r--) {
+		if (!(d = maildir_open_dir( ctx, r ))) {
+			maildir_perror( ctx, r, "." );
+			return -1;
+		}
+		while ((e = readdir( d ))) {
+			if (*e->d_name == '.')
+				continue;
+			nl = maildir_name_len( e->d_name );
+			if (!(imsg = maildir_index_find( ctx, e->d_name, nl )) || (imsg->gen.status & M_DEAD))
+				continue;
+			if (imsg == msg)
+				found = 1;
+			if ((imsg->gen.status & M_RECENT) != r || strcmp( imsg->base, e->d_name ))
+				maildir_relocated( ctx, imsg, e->d_name, r );
+		}
+		closedir( d );
+	}
+	return found;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+# define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+static void
+maildir_watch( maildir_store_t *ctx )
+{
+	int r;
+	char buf[_POSIX_PATH_MAX];
+
+	if ((ctx->wfd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC )) < 0) {
+		perror( "Maildir warning: inotify_init" );
+		return;
+	}
+	for (r = 0; r < 2; r++)
+		if ((ctx->wds[r] = inotify_add_watch( ctx->wfd, maildir_path( ctx, r, ".", buf, sizeof(buf) ), WATCH_MASK )) < 0) {
+			perror( buf );
+			close( ctx->wfd );
+			ctx->wfd = -1;
+			return;
+		}
+}
+
+/* Files we store ourselves show up as well; they are not changes by others. */
+static int
+maildir_own_name( const char *name )
+{
+	char tag[32];
+
+	nfsnprintf( tag, sizeof(tag), ".%d_", Pid );
+	return strstr( name, tag ) && strstr( name, Hostname );
+}
+
+/* Bring the message list up to date with what other programs did to the
+ * box since the last call: renamed messages are re-located, removed ones
+ * are marked dead, and any such change marks the box as changed. */
+static void
+maildir_drain( maildir_store_t *ctx )
+{
+	struct inotify_event *ev;
+	maildir_message_t *msg, **gone = 0;
+	char *p;
+	int len, r, i, ngone = 0, nalloc = 0;
+	struct stat st;
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} evs;
+
+	if (ctx->wfd < 0)
+		return;
+	if (!ctx->index)
+		maildir_build_index( ctx );
+	while ((len = read( ctx->wfd, evs.buf, sizeof(evs.buf) )) > 0) {
+		for (p = evs.buf; p < evs.buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Lost track; the ENOENT handling will have to do. */
+				ctx->changed = 1;
+				continue;
+			}
+			if (!ev->len || *ev->name == '.')
+				continue;
+			r = ev->wd == ctx->wds[1];
+			msg = maildir_index_find( ctx, ev->name, maildir_name_len( ev->name ) );
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				if (!msg) {
+					if (!maildir_own_name( ev->name ))
+						ctx->changed = 1;
+				} else if (!(msg->gen.status & M_DEAD) &&
+				           ((msg->gen.status & M_RECENT) != r || strcmp( msg->base, ev->name ))) {
+					maildir_relocated( ctx, msg, ev->name, r );
+					ctx->changed = 1;
+				}
+			} else if (msg && !(msg->gen.status & M_DEAD) &&
+			           (msg->gen.status & M_RECENT) == r && !strcmp( msg->base, ev->name )) {
+				/* This may be the first half of a rename, so decide later. */
+				if (ngone == nalloc)
+					gone = nfrealloc( gone, (nalloc = nalloc * 2 + 16) * sizeof(*gone) );
+				gone[ngone++] = msg;
+			}
+		}
+	}
+	for (i = 0; i < ngone; i++) {
+		msg = gone[i];
+		if (!(msg->gen.status & M_DEAD) &&
+		    fstatat( ctx->dfds[msg->gen.status & M_RECENT], msg->base, &st, 0 ) && errno == ENOENT) {
+			debug( "message %d vanished\n", msg->gen.uid );
+			msg->gen.status |= M_DEAD;
+			ctx->changed = 1;
+		}
+	}
+	free( gone );
+}
+#else
+static void
+maildir_watch( maildir_store_t *ctx )
+{
+	(void)ctx;
+	error( "Maildir warning: watching mailboxes is not supported on this system\n" );
+}
+
+static void
+maildir_drain( maildir_store_t *ctx )
+{
+	(void)ctx;
+}
+#endif
+
 static int
-maildir_again( maildir_store_t *ctx, maildir_message_t *msg, const char *fn )
+maildir_again( maildir_store_t *ctx, maildir_message_t *msg )
 {
 	int ret;
 
 	if (errno != ENOENT) {
-		perror( fn );
+		maildir_perror( ctx, msg->gen.status & M_RECENT, msg->base );
 		return DRV_BOX_BAD;
 	}
+	if (maildir_probe( ctx, msg ) || maildir_relocate( ctx, msg ) > 0)
+		return DRV_OK;
 	if ((ret = maildir_rescan( ctx )) != DRV_OK)
 		return ret;
 	return (msg->gen.status & M_DEAD) ? DRV_MSG_BAD : DRV_OK;
@@ -988,24 +1619,41 @@ maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
 	maildir_message_t *msg = (maildir_message_t *)gmsg;
 	int fd, ret;
 	struct stat st;
-	char buf[_POSIX_PATH_MAX];
 
+	maildir_drain( ctx );
+	if (gmsg->status & M_DEAD)
+		return cb( DRV_MSG_BAD, aux );
 	for (;;) {
-		nfsnprintf( buf, sizeof(buf), "%s/%s/%s", gctx->path, subdirs[gmsg->status & M_RECENT], msg->base );
-		if ((fd = open( buf, O_RDONLY )) >= 0)
+		if ((fd = openat( ctx->dfds[gmsg->status & M_RECENT], msg->base, O_RDONLY )) >= 0)
 			break;
-		if ((ret = maildir_again( ctx, msg, buf )) != DRV_OK)
+		if ((ret = maildir_again( ctx, msg )) != DRV_OK)
 			return cb( ret, aux );
 	}
 	fstat( fd, &st );
-	data->len = st.st_size;
-	data->data = nfmalloc( data->len );
-	if (read( fd, data->data, data->len ) != data->len) {
-		perror( buf );
+	if (data->want_tail || (global_spill_size && st.st_size > global_spill_size)) {
+		/* Only the header goes through memory; the body is copied
+		   straight from this file by the storing side. */
+		if ((data->len = read_msg_head( fd, data, st.st_size )) < 0) {
+			maildir_perror( ctx, gmsg->status & M_RECENT, msg->base );
+			free( data->data );
+			close( fd );
+			return cb( DRV_MSG_BAD, aux );
+		}
+		data->verbatim = 1;
+		data->tail_fd = fd;
+		data->tail_off = data->len;
+		data->tail_len = st.st_size - data->len;
+	} else {
+		data->len = st.st_size;
+		data->size = data->len + DATA_SLACK(data->len);
+		data->data = nfmalloc( data->size );
+		if (read( fd, data->data, data->len ) != data->len) {
+			maildir_perror( ctx, gmsg->status & M_RECENT, msg->base );
+			close( fd );
+			return cb( DRV_MSG_BAD, aux );
+		}
 		close( fd );
-		return cb( DRV_MSG_BAD, aux );
 	}
-	close( fd );
 	if (!(gmsg->status & M_FLAGS))
 		data->flags = maildir_parse_flags( msg->base );
 	return cb( DRV_OK, aux );
@@ -1026,77 +1674,307 @@ maildir_make_flags( int flags, char *buf )
 	return d;
 }
 
+static int
+maildir_sync_dir( maildir_store_t *ctx, int i )
+{
+	if (maildir_dir_fd( ctx, i ) < 0 || fsync( ctx->dfds[i] )) {
+		maildir_perror( ctx, i, "." );
+		return DRV_BOX_BAD;
+	}
+	return DRV_OK;
+}
+
+/* Mark a directory entry as dirty; i is the subdir index, plus 3 for the trash. */
+static int
+maildir_dirty_dir( maildir_store_t *ctx, int i )
+{
+	switch (((maildir_store_conf_t *)ctx->gen.conf)->fsync) {
+	case FSYNC_MESSAGE:
+		return maildir_sync_dir( ctx, i );
+	case FSYNC_BATCH:
+		ctx->sync_dirs |= 1 << i;
+		break;
+	}
+	return DRV_OK;
+}
+
+/* Group commit: sync the UID counter and all messages stored since the
+ * last call, and then the directories they were moved into. */
+static int
+maildir_sync_pending( maildir_store_t *ctx )
+{
+	int i, ret = DRV_OK;
+
+	if (ctx->sync_uv) {
+		if (fsync( ctx->uvfd )) {
+			error( "Maildir error: cannot fsync UIDVALIDITY.\n" );
+			ret = DRV_BOX_BAD;
+		}
+		ctx->sync_uv = 0;
+	}
+	for (i = 0; i < ctx->nsync_fds; i++) {
+		if (fsync( ctx->sync_fds[i] )) {
+			perror( "Maildir error: fsync" );
+			ret = DRV_BOX_BAD;
+		}
+		close( ctx->sync_fds[i] );
+	}
+	ctx->nsync_fds = 0;
+	for (i = 0; i < 6; i++)
+		if ((ctx->sync_dirs & (1 << i)) && maildir_sync_dir( ctx, i ) != DRV_OK)
+			ret = DRV_BOX_BAD;
+	ctx->sync_dirs = 0;
+	return ret;
+}
+
+static void
+maildir_free_data( msg_data_t *data )
+{
+	free( data->data );
+	if (data->tail_fd >= 0)
+		close( data->tail_fd );
+}
+
+/* Add the source file of verbatim data under the new name. */
+static int
+maildir_link_msg( msg_data_t *data, int dfd, const char *name )
+{
+#ifdef __linux__
+	char lbuf[32];
+
+	nfsnprintf( lbuf, sizeof(lbuf), "/proc/self/fd/%d", data->tail_fd );
+	return !linkat( AT_FDCWD, lbuf, dfd, name, AT_SYMLINK_FOLLOW );
+#else
+	(void)data;
+	(void)dfd;
+	(void)name;
+	return 0;
+#endif
+}
+
+static int
+maildir_write_tail( int fd, msg_data_t *data )
+{
+	char *tbuf;
+	off_t off = data->tail_off;
+	int left = data->tail_len, ret;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* This shares the extents on file systems supporting it. */
+	while (left) {
+		if ((ret = copy_file_range( data->tail_fd, &off, fd, 0, left, 0 )) <= 0) {
+			if (ret < 0 && off == data->tail_off &&
+			    (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+				goto fallback;
+			return -1;
+		}
+		left -= ret;
+	}
+	return 0;
+  fallback:
+#endif
+	tbuf = nfmalloc( TAIL_CHUNK );
+	while (left) {
+		if ((ret = pread( data->tail_fd, tbuf, left < TAIL_CHUNK ? left : TAIL_CHUNK, off )) <= 0 ||
+		    write( fd, tbuf, ret ) != ret) {
+			free( tbuf );
+			return -1;
+		}
+		off += ret;
+		left -= ret;
+	}
+	free( tbuf );
+	return 0;
+}
+
+static int
+maildir_write_msg( int fd, msg_data_t *data )
+{
+#ifdef FICLONE
+	if (data->tail_fd >= 0 && data->verbatim && !ioctl( fd, FICLONE, data->tail_fd ))
+		return 0;
+#endif
+	if (write( fd, data->data, data->len ) != data->len)
+		return -1;
+	if (data->tail_fd >= 0 && maildir_write_tail( fd, data ))
+		return -1;
+	return 0;
+}
+
+static void
+maildir_prefetch_msg( store_t *gctx, message_t *gmsg )
+{
+	(void)gctx;
+	(void)gmsg;
+}
+
+/* Make up a unique name for a new message in the box and assign it a UID. */
+static int
+maildir_new_base( maildir_store_t *ctx, char *base, int bufl, int *uid )
+{
+	int ret, bl;
+
+	bl = nfsnprintf( base, bufl, "%ld.%d_%d.%s", time( 0 ), Pid, ++MaildirCount, Hostname );
+#ifdef USE_DB
+	if (ctx->db)
+		return maildir_set_uid( ctx, base, uid );
+#endif /* USE_DB */
+	if (ctx->nuid < ctx->resv_uid)
+		*uid = ++ctx->nuid;
+	else if (ctx->gen.opts & OPEN_BULK) {
+		/* Hand out the UIDs in batches, so the lock is not taken for
+		   every single message. commit() gives back the unused ones. */
+		if ((ret = maildir_uidval_lock( ctx )) != DRV_OK)
+			return ret;
+		*uid = ctx->nuid + 1;
+		ctx->nuid += UID_BATCH;
+		if ((ret = maildir_store_uid( ctx )) != DRV_OK)
+			return ret;
+		maildir_uidval_unlock( ctx );
+		ctx->resv_uid = ctx->nuid;
+		ctx->nuid = *uid;
+	} else {
+		if ((ret = maildir_uidval_lock( ctx )) != DRV_OK ||
+		    (ret = maildir_obtain_uid( ctx, uid )) != DRV_OK)
+			return ret;
+		maildir_uidval_unlock( ctx );
+	}
+	nfsnprintf( base + bl, bufl - bl, ",U=%d", *uid );
+	return DRV_OK;
+}
+
 static int
 maildir_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
                    int (*cb)( int sts, int uid, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	const char *prefix, *box;
-	int ret, fd, bl, uid;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3], base[128];
+	int ret, fd, tfd, uid, i, d;
+	char nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3], base[128];
 
-	bl = nfsnprintf( base, sizeof(base), "%ld.%d_%d.%s", time( 0 ), Pid, ++MaildirCount, Hostname );
 	if (!to_trash) {
-#ifdef USE_DB
-		if (ctx->db) {
-			if ((ret = maildir_set_uid( ctx, base, &uid )) != DRV_OK) {
-				free( data->data );
-				return cb( ret, 0, aux );
-			}
-		} else
-#endif /* USE_DB */
-		{
-			if ((ret = maildir_uidval_lock( ctx )) != DRV_OK ||
-			    (ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK)
-				return cb( ret, 0, aux );
-			maildir_uidval_unlock( ctx );
-			nfsnprintf( base + bl, sizeof(base) - bl, ",U=%d", uid );
+		if ((ret = maildir_new_base( ctx, base, sizeof(base), &uid )) != DRV_OK) {
+			maildir_free_data( data );
+			return cb( ret, 0, aux );
 		}
-		prefix = gctx->path;
-		box = "";
+		d = 0;
 	} else {
-		prefix = gctx->conf->path;
-		box = gctx->conf->trash;
+		nfsnprintf( base, sizeof(base), "%ld.%d_%d.%s", time( 0 ), Pid, ++MaildirCount, Hostname );
+		d = 3;
 	}
 
 	maildir_make_flags( data->flags, fbuf );
-	nfsnprintf( buf, sizeof(buf), "%s%s/tmp/%s%s", prefix, box, base, fbuf );
-	if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
-		if (errno != ENOENT) {
-			perror( buf );
-			free( data->data );
-			return cb( DRV_BOX_BAD, 0, aux );
-		}
-		if ((ret = maildir_validate( gctx->conf->path, gctx->conf->trash, gctx->opts & OPEN_CREATE )) != DRV_OK) {
-			free( data->data );
-			return cb( ret, 0, aux );
+	nfsnprintf( nbuf, sizeof(nbuf), "%s%s", base, fbuf );
+	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
+	i = !(data->flags & F_SEEN);
+	if (data->tail_fd >= 0 && data->verbatim && maildir_dir_fd( ctx, d + i ) >= 0 &&
+	    maildir_link_msg( data, ctx->dfds[d + i], nbuf )) {
+		/* Nothing to write, and the link is atomic, so tmp/ is not needed. */
+		free( data->data );
+		fd = data->tail_fd;
+		tfd = -1;
+	} else {
+		if ((tfd = maildir_dir_fd( ctx, d + 2 )) < 0 ||
+		    (fd = openat( tfd, nbuf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+			if (errno != ENOENT) {
+				maildir_perror( ctx, d + 2, nbuf );
+				maildir_free_data( data );
+				return cb( DRV_BOX_BAD, 0, aux );
+			}
+			if ((ret = maildir_validate( gctx->conf->path, gctx->conf->trash, gctx->opts & OPEN_CREATE )) != DRV_OK) {
+				maildir_free_data( data );
+				return cb( ret, 0, aux );
+			}
+			if ((tfd = maildir_dir_fd( ctx, d + 2 )) < 0 ||
+			    (fd = openat( tfd, nbuf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+				maildir_perror( ctx, d + 2, nbuf );
+				maildir_free_data( data );
+				return cb( DRV_BOX_BAD, 0, aux );
+			}
 		}
-		if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
-			perror( buf );
-			free( data->data );
+		errno = 0;
+		ret = maildir_write_msg( fd, data );
+		maildir_free_data( data );
+		if (ret) {
+			if (errno)
+				maildir_perror( ctx, d + 2, nbuf );
+			else
+				maildir_error( ctx, d + 2, nbuf, "partial write" );
+			close( fd );
 			return cb( DRV_BOX_BAD, 0, aux );
 		}
 	}
-	ret = write( fd, data->data, data->len );
-	free( data->data );
-	if (ret != data->len) {
-		if (ret < 0)
-			perror( buf );
-		else
-			error( "Maildir error: %s: partial write\n", buf );
+	switch (((maildir_store_conf_t *)gctx->conf)->fsync) {
+	case FSYNC_MESSAGE:
+		if (fsync( fd )) {
+			maildir_perror( ctx, tfd >= 0 ? d + 2 : d + i, nbuf );
+			close( fd );
+			return cb( DRV_BOX_BAD, 0, aux );
+		}
+		/* fallthrough */
+	case FSYNC_NONE:
 		close( fd );
-		return cb( DRV_BOX_BAD, 0, aux );
+		break;
+	default:
+		/* The data is synced together with the directory by maildir_commit(). */
+		if (ctx->nsync_fds == MAX_SYNC_FDS && (ret = maildir_sync_pending( ctx )) != DRV_OK) {
+			close( fd );
+			return cb( ret, 0, aux );
+		}
+		if (!ctx->sync_fds)
+			ctx->sync_fds = nfmalloc( MAX_SYNC_FDS * sizeof(int) );
+		ctx->sync_fds[ctx->nsync_fds++] = fd;
+		break;
 	}
-	close( fd );
-	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
-	nfsnprintf( nbuf, sizeof(nbuf), "%s%s/%s/%s%s", prefix, box, subdirs[!(data->flags & F_SEEN)], base, fbuf );
-	if (rename( buf, nbuf )) {
-		perror( nbuf );
+	if (tfd >= 0 && renameat( tfd, nbuf, ctx->dfds[d + i], nbuf )) {
+		maildir_perror( ctx, d + i, nbuf );
 		return cb( DRV_BOX_BAD, 0, aux );
 	}
+	if ((ret = maildir_dirty_dir( ctx, d + i )) != DRV_OK)
+		return cb( ret, 0, aux );
 	return cb( DRV_OK, uid, aux );
 }
 
+static int
+maildir_load_msgids( store_t *gctx, message_t **msgs, int nmsgs,
+                     int (*cb)( int sts, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_message_t *msg;
+	msg_data_t head;
+	struct stat st;
+	int i, fd, hl, ret;
+
+	maildir_drain( ctx );
+	for (i = 0; i < nmsgs; i++) {
+		msg = (maildir_message_t *)msgs[i];
+		if (msg->gen.msgid)
+			continue;
+		for (;;) {
+			if (msg->gen.status & M_DEAD)
+				goto next;
+			if ((fd = openat( ctx->dfds[msg->gen.status & M_RECENT], msg->base, O_RDONLY )) >= 0)
+				break;
+			if ((ret = maildir_again( ctx, msg )) == DRV_MSG_BAD)
+				goto next;
+			if (ret != DRV_OK)
+				return cb( ret, aux );
+		}
+		head.data = 0;
+		if (fstat( fd, &st ) || (hl = read_msg_head( fd, &head, st.st_size )) < 0)
+			maildir_perror( ctx, msg->gen.status & M_RECENT, msg->base );
+		else if ((msg->gen.msgid = get_msgid( head.data, hl )) &&
+		         (ctx->gen.opts & OPEN_LINES) && (msg->gen.lines = count_lines( fd )) < 0) {
+			maildir_perror( ctx, msg->gen.status & M_RECENT, msg->base );
+			free( msg->gen.msgid );
+			msg->gen.msgid = 0;
+		}
+		free( head.data );
+		close( fd );
+	  next: ;
+	}
+	return cb( DRV_OK, aux );
+}
+
 static int
 maildir_find_msg( store_t *gctx, const char *tuid,
                   int (*cb)( int sts, int uid, void *aux ), void *aux )
@@ -1118,23 +1996,21 @@ maildir_set_flags( store_t *gctx, message_t *gmsg, int uid, int add, int del,
 	maildir_message_t *msg = (maildir_message_t *)gmsg;
 	char *s, *p;
 	unsigned i;
-	int j, ret, ol, fl, bbl, bl, tl;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+	int j, ret, ol, fl, tl;
+	char nbuf[_POSIX_PATH_MAX];
 
 	(void) uid;
-	bbl = nfsnprintf( buf, sizeof(buf), "%s/", gctx->path );
-	memcpy( nbuf, gctx->path, bbl - 1 );
-	memcpy( nbuf + bbl - 1, "/cur/", 5 );
+	maildir_drain( ctx );
+	if (gmsg->status & M_DEAD)
+		return cb( DRV_MSG_BAD, aux );
 	for (;;) {
-		bl = bbl + nfsnprintf( buf + bbl, sizeof(buf) - bbl, "%s/", subdirs[gmsg->status & M_RECENT] );
 		ol = strlen( msg->base );
-		if ((int)sizeof(buf) - bl < ol + 3 + NUM_FLAGS)
+		if ((int)sizeof(nbuf) < ol + 3 + NUM_FLAGS)
 			oob();
-		memcpy( buf + bl, msg->base, ol + 1 );
-		memcpy( nbuf + bl, msg->base, ol + 1 );
-		if ((s = strstr( nbuf + bl, ":2," ))) {
+		memcpy( nbuf, msg->base, ol + 1 );
+		if ((s = strstr( nbuf, ":2," ))) {
 			s += 3;
-			fl = ol - (s - (nbuf + bl));
+			fl = ol - (s - nbuf);
 			for (i = 0; i < as(Flags); i++) {
 				if ((p = strchr( s, Flags[i] ))) {
 					if (del & (1 << i)) {
@@ -1150,16 +2026,16 @@ maildir_set_flags( store_t *gctx, message_t *gmsg, int uid, int add, int del,
 			}
 			tl = ol + 3 + fl;
 		} else {
-			tl = ol + maildir_make_flags( msg->gen.flags, nbuf + bl + ol );
+			tl = ol + maildir_make_flags( msg->gen.flags, nbuf + ol );
 		}
-		if (!rename( buf, nbuf ))
+		if (!renameat( ctx->dfds[gmsg->status & M_RECENT], msg->base, ctx->dfds[0], nbuf ))
 			break;
-		if ((ret = maildir_again( ctx, msg, buf )) != DRV_OK)
+		if ((ret = maildir_again( ctx, msg )) != DRV_OK)
 			return cb( ret, aux );
 	}
 	free( msg->base );
 	msg->base = nfmalloc( tl + 1 );
-	memcpy( msg->base, nbuf + bl, tl + 1 );
+	memcpy( msg->base, nbuf, tl + 1 );
 	msg->gen.flags |= add;
 	msg->gen.flags &= ~del;
 	gmsg->status &= ~M_RECENT;
@@ -1191,32 +2067,37 @@ maildir_trash_msg( store_t *gctx, message_t *gmsg,
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 	maildir_message_t *msg = (maildir_message_t *)gmsg;
 	char *s;
-	int ret;
+	int ret, r;
 	struct stat st;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+	char nbuf[_POSIX_PATH_MAX];
 
+	maildir_drain( ctx );
+	if (gmsg->status & M_DEAD)
+		return cb( DRV_MSG_BAD, aux );
 	for (;;) {
-		nfsnprintf( buf, sizeof(buf), "%s/%s/%s", gctx->path, subdirs[gmsg->status & M_RECENT], msg->base );
+		r = gmsg->status & M_RECENT;
 		s = strstr( msg->base, ":2," );
-		nfsnprintf( nbuf, sizeof(nbuf), "%s%s/%s/%ld.%d_%d.%s%s", gctx->conf->path, gctx->conf->trash,
-		            subdirs[gmsg->status & M_RECENT], time( 0 ), Pid, ++MaildirCount, Hostname, s ? s : "" );
-		if (!rename( buf, nbuf ))
+		nfsnprintf( nbuf, sizeof(nbuf), "%ld.%d_%d.%s%s",
+		            time( 0 ), Pid, ++MaildirCount, Hostname, s ? s : "" );
+		if (maildir_dir_fd( ctx, r + 3 ) >= 0 && !renameat( ctx->dfds[r], msg->base, ctx->dfds[r + 3], nbuf ))
 			break;
-		if (!stat( buf, &st )) {
+		if (!fstatat( ctx->dfds[r], msg->base, &st, 0 )) {
 			if ((ret = maildir_validate( gctx->conf->path, gctx->conf->trash, 1 )) != DRV_OK)
 				return cb( ret, aux );
-			if (!rename( buf, nbuf ))
+			if (maildir_dir_fd( ctx, r + 3 ) >= 0 && !renameat( ctx->dfds[r], msg->base, ctx->dfds[r + 3], nbuf ))
 				break;
 			if (errno != ENOENT) {
-				perror( nbuf );
+				maildir_perror( ctx, r + 3, nbuf );
 				return cb( DRV_BOX_BAD, aux );
 			}
 		}
-		if ((ret = maildir_again( ctx, msg, buf )) != DRV_OK)
+		if ((ret = maildir_again( ctx, msg )) != DRV_OK)
 			return cb( ret, aux );
 	}
 	gmsg->status |= M_DEAD;
 	gctx->count--;
+	if ((ret = maildir_dirty_dir( ctx, (gmsg->status & M_RECENT) + 3 )) != DRV_OK)
+		return cb( ret, aux );
 
 #ifdef USE_DB
 	if (ctx->db)
@@ -1225,28 +2106,185 @@ maildir_trash_msg( store_t *gctx, message_t *gmsg,
 	return cb( DRV_OK, aux );
 }
 
+/* An MUA may have renamed a stashed file meanwhile, to change its flags
+   or to move it to cur/. Find it by the unique part of its name again. */
+static int
+maildir_refind_stash( maildir_stash_t *st )
+{
+	DIR *d;
+	struct dirent *e;
+	char *dir, *u;
+	int i, ul;
+
+	u = st->path + st->blen + 5;
+	ul = strcspn( u, ":" );
+	for (i = 0; i < 2; i++) {
+		nfasprintf( &dir, "%.*s/%s", st->blen, st->path, subdirs[i] );
+		if ((d = opendir( dir ))) {
+			while ((e = readdir( d )))
+				if (!strncmp( e->d_name, u, ul ) && (!e->d_name[ul] || e->d_name[ul] == ':')) {
+					free( st->path );
+					nfasprintf( &st->path, "%s/%s", dir, e->d_name );
+					closedir( d );
+					free( dir );
+					return 1;
+				}
+			closedir( d );
+		}
+		free( dir );
+	}
+	return 0;
+}
+
+static int
+maildir_stash_msg( store_t *gctx, message_t *gmsg,
+                   int (*cb)( int sts, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_message_t *msg = (maildir_message_t *)gmsg;
+	maildir_stash_t *st;
+	const char *p, *q, *e;
+	char *msgid;
+	int ret, fd, r, n, hl, len, lines;
+	msg_data_t head;
+	struct stat sb;
+	char buf[4096];
+
+	maildir_drain( ctx );
+	if (gmsg->status & M_DEAD)
+		return cb( DRV_MSG_BAD, aux );
+	/* Moves are recognized by Message-ID and size; as the size
+	   on the other side depends on the line endings, count them.
+	   Only the header, up to SpillSize, is held in memory. */
+	for (;;) {
+		if ((fd = openat( ctx->dfds[gmsg->status & M_RECENT], msg->base, O_RDONLY )) >= 0)
+			break;
+		if ((ret = maildir_again( ctx, msg )) != DRV_OK)
+			return cb( ret, aux );
+	}
+	r = gmsg->status & M_RECENT;
+	fstat( fd, &sb );
+	len = sb.st_size;
+	hl = (global_spill_size && len > global_spill_size) ? global_spill_size : len;
+	if ((hl = read_msg_head( fd, &head, hl )) < 0)
+		goto rerr;
+	if (!(msgid = get_msgid( head.data, hl ))) {
+		free( head.data );
+		close( fd );
+		return maildir_set_flags( gctx, gmsg, gmsg->uid, F_DELETED, 0, cb, aux );
+	}
+	for (lines = 0, p = head.data, e = head.data + hl; (p = memchr( p, '\n', e - p )); p++)
+		lines++;
+	while ((n = read( fd, buf, sizeof(buf) )) > 0)
+		for (p = buf, e = buf + n; (p = memchr( p, '\n', e - p )); p++)
+			lines++;
+	if (n < 0) {
+		free( msgid );
+		goto rerr;
+	}
+	close( fd );
+	e = (p = memmem( head.data, hl, "\n\n", 2 )) ? p + 1 : head.data + hl;
+	for (p = head.data; (q = memchr( p, '\n', e - p )); p = q + 1)
+		if (q - p == 8 + TUIDL && !memcmp( p, "X-TUID: ", 8 )) {
+			len -= 9 + TUIDL;
+			lines--;
+			break;
+		}
+	free( head.data );
+
+	/* The file stays where it is until it is adopted or the store is
+	   disowned, so a crash leaves it in its box rather than losing it.
+	   Its UID stays as well; it is at most the synced maximum, so the
+	   next run will not take the leftover for a new message. */
+	gmsg->status |= M_DEAD;
+	gctx->count--;
+	st = nfmalloc( sizeof(*st) );
+	st->blen = strlen( gctx->path );
+	nfasprintf( &st->path, "%s/%s/%s", gctx->path, subdirs[r], msg->base );
+	st->msgid = msgid;
+	st->size = len;
+	st->lines = lines;
+	st->next = ctx->stash;
+	ctx->stash = st;
+	gctx->stashed++;
+	return cb( DRV_OK, aux );
+
+  rerr:
+	maildir_perror( ctx, r, msg->base );
+	free( head.data );
+	close( fd );
+	return cb( DRV_MSG_BAD, aux );
+}
+
+static int
+maildir_adopt_msg( store_t *gctx, const char *msgid, int size, int crlf, int flags,
+                   int (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_stash_t *st, **stp;
+	int ret, uid, i, sz;
+	char nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3], base[128];
+
+	for (stp = &ctx->stash; (st = *stp); stp = &st->next) {
+		sz = st->size + (crlf ? st->lines : 0);
+		/* the other copy may carry an X-TUID as well */
+		if ((size == sz || size == sz + 9 + TUIDL + crlf) && !strcmp( st->msgid, msgid ))
+			goto found;
+	}
+	return cb( DRV_MSG_BAD, 0, aux );
+
+  found:
+	if ((ret = maildir_new_base( ctx, base, sizeof(base), &uid )) != DRV_OK)
+		return cb( ret, 0, aux );
+	maildir_make_flags( flags, fbuf );
+	nfsnprintf( nbuf, sizeof(nbuf), "%s%s", base, fbuf );
+	i = !(flags & F_SEEN);
+	while (maildir_dir_fd( ctx, i ) < 0 || renameat( AT_FDCWD, st->path, ctx->dfds[i], nbuf )) {
+		if (errno == EXDEV)
+			return cb( DRV_MSG_BAD, 0, aux ); /* will be deleted in the end */
+		if (errno != ENOENT) {
+			perror( st->path );
+			return cb( DRV_BOX_BAD, 0, aux );
+		}
+		if (!maildir_refind_stash( st )) {
+			/* somebody deleted it under our feet */
+			uid = 0;
+			break;
+		}
+	}
+	*stp = st->next;
+	free( st->msgid );
+	free( st->path );
+	free( st );
+	gctx->stashed--;
+	if (!uid)
+		return cb( DRV_MSG_BAD, 0, aux );
+	if ((ret = maildir_dirty_dir( ctx, i )) != DRV_OK)
+		return cb( ret, 0, aux );
+	return cb( DRV_OK, uid, aux );
+}
+
 static int
 maildir_close( store_t *gctx,
                int (*cb)( int sts, void *aux ), void *aux )
 {
-#ifdef USE_DB
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-#endif /* USE_DB */
 	message_t *msg;
-	int basel, retry, ret;
-	char buf[_POSIX_PATH_MAX];
+	int retry, relocated = 0, ret;
 
+	/* Trashed copies must hit the disk before the originals go away. */
+	if ((ret = maildir_sync_pending( ctx )) != DRV_OK)
+		return cb( ret, aux );
+	maildir_drain( ctx );
 	for (;;) {
 		retry = 0;
-		basel = nfsnprintf( buf, sizeof(buf), "%s/", gctx->path );
 		for (msg = gctx->msgs; msg; msg = msg->next)
 			if (!(msg->status & M_DEAD) && (msg->flags & F_DELETED)) {
-				nfsnprintf( buf + basel, sizeof(buf) - basel, "%s/%s", subdirs[msg->status & M_RECENT], ((maildir_message_t *)msg)->base );
-				if (unlink( buf )) {
+				if (unlinkat( ctx->dfds[msg->status & M_RECENT], ((maildir_message_t *)msg)->base, 0 )) {
 					if (errno == ENOENT)
 						retry = 1;
 					else
-						perror( buf );
+						maildir_perror( ctx, msg->status & M_RECENT, ((maildir_message_t *)msg)->base );
 				} else {
 					msg->status |= M_DEAD;
 					gctx->count--;
@@ -1258,7 +2296,11 @@ maildir_close( store_t *gctx,
 			}
 		if (!retry)
 			return cb( DRV_OK, aux );
-		if ((ret = maildir_rescan( (maildir_store_t *)gctx )) != DRV_OK)
+		/* One pass to pick up renamed messages should do; if something
+		   is still missing, it is time for the big hammer. */
+		if (!relocated && maildir_relocate( ctx, 0 ) >= 0)
+			relocated = 1;
+		else if ((ret = maildir_rescan( ctx )) != DRV_OK)
 			return cb( ret, aux );
 	}
 }
@@ -1272,9 +2314,32 @@ maildir_cancel( store_t *gctx,
 }
 
 static void
+maildir_release_uids( maildir_store_t *ctx )
+{
+	int nuid = ctx->nuid;
+
+	if (nuid >= ctx->resv_uid)
+		return;
+	/* Give back the unused part of the batch, unless somebody
+	   else has allocated UIDs after it meanwhile. */
+	if (maildir_uidval_lock( ctx ) != DRV_OK)
+		return;
+	if (ctx->nuid == ctx->resv_uid) {
+		ctx->nuid = nuid;
+		maildir_store_uid( ctx );
+	}
+	maildir_uidval_unlock( ctx );
+	ctx->resv_uid = 0;
+}
+
+static int
 maildir_commit( store_t *gctx )
 {
-	(void) gctx;
+	int ret;
+
+	ret = maildir_sync_pending( (maildir_store_t *)gctx );
+	maildir_release_uids( (maildir_store_t *)gctx );
+	return ret;
 }
 
 static int
@@ -1297,7 +2362,21 @@ maildir_parse_store( conffile_t *cfg, store_conf_t **storep, int *err )
 		else if (!strcasecmp( "AltMap", cfg->cmd ))
 			store->alt_map = parse_bool( cfg );
 #endif /* USE_DB */
-		else
+		else if (!strcasecmp( "Watch", cfg->cmd ))
+			store->watch = parse_bool( cfg );
+		else if (!strcasecmp( "FSync", cfg->cmd )) {
+			if (!strcasecmp( "None", cfg->val ))
+				store->fsync = FSYNC_NONE;
+			else if (!strcasecmp( "Message", cfg->val ))
+				store->fsync = FSYNC_MESSAGE;
+			else if (!strcasecmp( "Batch", cfg->val ))
+				store->fsync = FSYNC_BATCH;
+			else {
+				error( "%s:%d: invalid FSync arg '%s'\n",
+				       cfg->file, cfg->line, cfg->val );
+				*err = 1;
+			}
+		} else
 			parse_generic_store( &store->gen, cfg, err );
 	if (!store->inbox)
 		store->inbox = expand_strdup( "~/Maildir" );
@@ -1306,7 +2385,7 @@ maildir_parse_store( conffile_t *cfg, store_conf_t **storep, int *err )
 }
 
 struct driver maildir_driver = {
-	0,
+	DRV_FDCOPY | DRV_UIDS,
 	maildir_parse_store,
 	maildir_cleanup_drv,
 	maildir_open_store,
@@ -1318,10 +2397,14 @@ struct driver maildir_driver = {
 	maildir_prepare_opts,
 	maildir_select,
 	maildir_fetch_msg,
+	maildir_prefetch_msg,
 	maildir_store_msg,
 	maildir_find_msg,
+	maildir_load_msgids,
 	maildir_set_flags,
 	maildir_trash_msg,
+	maildir_stash_msg,
+	maildir_adopt_msg,
 	maildir_close,
 	maildir_cancel,
 	maildir_commit,
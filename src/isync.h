@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <signal.h>
 
 #define as(ar) (sizeof(ar)/sizeof(ar[0]))
 
@@ -99,6 +100,9 @@ typedef struct channel_conf {
 	string_list_t *patterns;
 	int ops[2];
 	unsigned max_messages; /* for slave only */
+	unsigned sync_window; /* UIDs per pass; 0 for all at once */
+	unsigned detect_moves:1;
+	unsigned recover_uidval:1;
 } channel_conf_t;
 
 typedef struct group_conf {
@@ -126,11 +130,22 @@ typedef struct message {
 	struct message *next;
 	struct sync_rec *srec;
 	/* string_list_t *keywords; */
+	char *msgid; /* with OPEN_MSGID only; may be null anyway */
 	size_t size; /* zero implies "not fetched" */
+	int lines; /* with OPEN_LINES only */
 	int uid;
 	unsigned char flags, status;
 } message_t;
 
+/* Backing storage of a store's messages; see new_message(). */
+typedef struct msg_block {
+	struct msg_block *next;
+	int size, used, alloc;
+	/* followed by alloc messages of size bytes each */
+} msg_block_t;
+
+#define block_msg(blk, i) ((message_t *)((char *)((blk) + 1) + (i) * (blk)->size))
+
 /* For opts, both in store and driver_t->select() */
 #define OPEN_OLD        (1<<0)
 #define OPEN_NEW        (1<<1)
@@ -141,30 +156,62 @@ typedef struct message {
 #define OPEN_SETFLAGS   (1<<6)
 #define OPEN_APPEND     (1<<7)
 #define OPEN_FIND       (1<<8)
+#define OPEN_MSGID      (1<<9)
+#define OPEN_BULK       (1<<10) /* set after select(): many messages are about to be stored */
+#define OPEN_READONLY   (1<<11) /* select() must not modify the box */
+#define OPEN_LINES      (1<<12) /* count the lines of messages whose Message-ID is loaded */
 
 typedef struct store {
 	struct store *next;
 	store_conf_t *conf; /* foreign */
 	string_list_t *boxes; /* _list results - own */
 	unsigned listed:1; /* was _list already run? */
+	unsigned uidplus:1; /* store_msg() reports the UIDs of new messages; set by select(),
+	                       cleared by store_msg() once it fails to */
 
 	/* currently open mailbox */
 	const char *name; /* foreign! maybe preset? */
 	char *path; /* own */
 	message_t *msgs; /* own */
+	message_t **msgapp; /* end of msgs */
+	msg_block_t *msgblocks; /* own */
+	message_t **msgidx; /* own; msgs sorted by UID - built on demand */
+	int nmsgidx;
 	int uidvalidity;
 	unsigned opts; /* maybe preset? */
 	/* note that the following do _not_ reflect stats from msgs, but mailbox totals */
 	int count; /* # of messages */
+	int uidnext; /* UID the next message will get; 0 if unknown */
 	int recent; /* # of recent messages - don't trust this beyond the initial read */
+	int stashed; /* # of messages held back by stash_msg(); survives box changes */
+	/* seconds spent connecting to and logging into the store, and listing
+	   the messages of the currently open mailbox */
+	double connect_time, auth_time, list_time;
 } store_t;
 
 typedef struct {
 	char *data;
 	int len;
+	int size; /* allocated size of data; may exceed len to allow rewriting in place */
 	unsigned char flags;
+	/* Between two DRV_FDCOPY stores, the fetched data may be only the head
+	   of the message if want_tail is set; the rest is then tail_len bytes
+	   at tail_off in tail_fd (-1 otherwise). Messages bigger than SpillSize
+	   are delivered that way regardless. verbatim means that data is
+	   still the unmodified start of that file. */
+	unsigned char want_tail, verbatim;
+	int tail_fd, tail_off, tail_len;
 } msg_data_t;
 
+/* Headroom drivers should allocate after fetched message data; enough for
+   an X-TUID line and CR insertion in the header. */
+#define DATA_SLACK(len) ((len) / 32 + 64)
+
+/* Message headers are read in chunks of HEAD_CHUNK, and tails are
+   copied in chunks of TAIL_CHUNK. */
+#define HEAD_CHUNK 4096
+#define TAIL_CHUNK (HEAD_CHUNK * 16)
+
 #define DRV_OK          0
 #define DRV_MSG_BAD     1
 #define DRV_BOX_BAD     2
@@ -175,6 +222,8 @@ typedef struct {
 /* All memory belongs to the driver's user. */
 
 #define DRV_CRLF        1
+#define DRV_FDCOPY      2
+#define DRV_UIDS        4 /* store_msg() always reports the UIDs of new messages */
 
 #define TUIDL 12
 
@@ -195,19 +244,35 @@ struct driver {
 	               int (*cb)( int sts, void *aux ), void *aux );
 	int (*fetch_msg)( store_t *ctx, message_t *msg, msg_data_t *data,
 	                  int (*cb)( int sts, void *aux ), void *aux );
+	void (*prefetch_msg)( store_t *ctx, message_t *msg ); /* hint that fetch_msg will follow */
 	int (*store_msg)( store_t *ctx, msg_data_t *data, int to_trash,
 	                  int (*cb)( int sts, int uid, void *aux ), void *aux );
 	int (*find_msg)( store_t *ctx, const char *tuid,
 	                 int (*cb)( int sts, int uid, void *aux ), void *aux );
+	/* Fetch the Message-IDs of some already listed messages, as if they
+	   had been listed with OPEN_MSGID. msgs must be sorted by UID. */
+	int (*load_msgids)( store_t *ctx, message_t **msgs, int nmsgs,
+	                    int (*cb)( int sts, void *aux ), void *aux );
 	int (*set_flags)( store_t *ctx, message_t *msg, int uid, int add, int del, /* msg can be null, therefore uid as a fallback */
 	                  int (*cb)( int sts, void *aux ), void *aux );
 	int (*trash_msg)( store_t *ctx, message_t *msg, /* This may expunge the original message immediately, but it needn't to */
 	                  int (*cb)( int sts, void *aux ), void *aux );
+	/* Remove the message from the box, but keep it around until the store
+	   is disowned, so adopt_msg() can move it into another box. Drivers which
+	   cannot do that just flag the message deleted. */
+	int (*stash_msg)( store_t *ctx, message_t *msg,
+	                  int (*cb)( int sts, void *aux ), void *aux );
+	/* Move a stashed message with the given Message-ID into the current box.
+	   size is as a driver with/without DRV_CRLF (crlf) would report it. Fails
+	   with DRV_MSG_BAD if there is no such message. */
+	int (*adopt_msg)( store_t *ctx, const char *msgid, int size, int crlf, int flags,
+	                  int (*cb)( int sts, int uid, void *aux ), void *aux );
 	int (*close)( store_t *ctx, /* IMAP-style: expunge inclusive */
 	              int (*cb)( int sts, void *aux ), void *aux );
 	void (*cancel)( store_t *ctx, /* only not yet sent commands */
 	                void (*cb)( int sts, void *aux ), void *aux );
-	void (*commit)( store_t *ctx );
+	/* Make everything stored so far survive a crash. */
+	int (*commit)( store_t *ctx );
 };
 
 
@@ -225,8 +290,10 @@ extern const char *Home;
 #define QUIET        4
 #define VERYQUIET    8
 #define KEEPJOURNAL  16
+#define DRYRUN       32
 
 extern int DFlags, Ontty;
+extern volatile sig_atomic_t StatsDump; /* set by SIGUSR1 */
 
 void debug( const char *, ... );
 void debugn( const char *, ... );
@@ -240,7 +307,10 @@ char *next_arg( char ** );
 void add_string_list( string_list_t **list, const char *str );
 void free_string_list( string_list_t *list );
 
-void free_generic_messages( message_t * );
+void reserve_messages( store_t *ctx, int size, int count );
+message_t *new_message( store_t *ctx, int size );
+void free_generic_messages( store_t *ctx );
+message_t *find_uid_msg( store_t *ctx, int uid );
 
 void *nfmalloc( size_t sz );
 void *nfcalloc( size_t sz );
@@ -253,6 +323,18 @@ void ATTR_NORETURN oob( void );
 
 char *expand_strdup( const char *s );
 
+char *get_msgid( const char *hdr, int len );
+int read_msg_head( int fd, msg_data_t *data, int size );
+int spill_file( void );
+
+int conv_copy( char *dst, const char *src, int n, int cra, int crd );
+void conv_copy_back( char *buf, int from, int n, int to, int nlf );
+int count_chr( const char *p, int n, char c );
+
+double get_time( void );
+char *json_quote( const char *s );
+void stats_record( const char *fmt, ... );
+
 void sort_ints( int *arr, int len );
 
 void arc4_init( void );
@@ -282,6 +364,14 @@ extern group_conf_t *groups;
 extern int global_ops[2];
 extern char *global_sync_state;
 
+#define STATE_TEXT    0
+#define STATE_BINARY  1
+extern int global_state_format;
+extern int global_state_log;
+extern int global_state_fsync;
+extern char *global_stats_file;
+extern int global_spill_size;
+
 int parse_bool( conffile_t *cfile );
 int parse_int( conffile_t *cfile );
 int parse_size( conffile_t *cfile );
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/wait.h>
 
 int Pid;		/* for maildir and imap */
@@ -62,6 +63,7 @@ PACKAGE " " VERSION " - mailbox synchronizer\n"
 "  -H, --push		propagate from slave to master\n"
 "  -C, --create		create mailboxes if nonexistent\n"
 "  -X, --expunge		expunge	deleted messages\n"
+"  -P, --plan		show what would be synchronized, but do nothing\n"
 "  -c, --config CONFIG	read an alternate config file (default: ~/." EXE "rc)\n"
 "  -D, --debug		print debugging messages\n"
 "  -V, --verbose		verbose mode (display network traffic)\n"
@@ -83,6 +85,13 @@ PACKAGE " " VERSION " - mailbox synchronizer\n"
 	exit( code );
 }
 
+static void
+statsHandler( int n )
+{
+	(void)n;
+	StatsDump = 1;
+}
+
 #ifdef __linux__
 static void
 crashHandler( int n )
@@ -198,6 +207,8 @@ typedef struct {
 	const char *names[2];
 	char **argv, *boxlist, *boxp;
 	int oind, ret, multiple, all, list, ops[2], state[2];
+	int nboxes; /* synced in the current channel */
+	double start, connect_time, auth_time;
 	unsigned done:1, skip:1, cben:1;
 } main_vars_t;
 
@@ -256,6 +267,8 @@ main( int argc, char **argv )
 					mvars->all = 1;
 				else if (!strcmp( opt, "list" ))
 					mvars->list = 1;
+				else if (!strcmp( opt, "plan" ))
+					DFlags |= DRYRUN;
 				else if (!strcmp( opt, "help" ))
 					usage( 0 );
 				else if (!strcmp( opt, "version" ))
@@ -432,6 +445,9 @@ main( int argc, char **argv )
 		case 'J':
 			DFlags |= KEEPJOURNAL;
 			break;
+		case 'P':
+			DFlags |= DRYRUN;
+			break;
 		case 'v':
 			version();
 		case 'h':
@@ -456,6 +472,9 @@ main( int argc, char **argv )
 	if (load_config( config, pseudo ))
 		return 1;
 
+	if (global_stats_file)
+		signal( SIGUSR1, statsHandler );
+
 	if (!mvars->all && !argv[mvars->oind]) {
 		fputs( "No channel specified. Try '" EXE " -h'\n", stderr );
 		return 1;
@@ -493,6 +512,21 @@ static void done_sync( int sts, void *aux );
 
 #define nz(a,b) ((a)?(a):(b))
 
+static void
+record_chan_stats( main_vars_t *mvars )
+{
+	char *chan;
+
+	if (!global_stats_file || mvars->list || (DFlags & DRYRUN))
+		return;
+	chan = json_quote( mvars->chan->name );
+	stats_record( "{\"type\":\"channel\",\"time\":%ld,\"channel\":%s,"
+	              "\"phases\":{\"connect\":%.6f,\"auth\":%.6f},\"boxes\":%d,\"seconds\":%.6f}\n",
+	              (long)time( 0 ), chan, mvars->connect_time, mvars->auth_time,
+	              mvars->nboxes, get_time() - mvars->start );
+	free( chan );
+}
+
 static void
 sync_chans( main_vars_t *mvars, int ent )
 {
@@ -541,6 +575,9 @@ sync_chans( main_vars_t *mvars, int ent )
 
 		mvars->state[M] = mvars->state[S] = ST_FRESH;
 		info( "Channel %s\n", mvars->chan->name );
+		mvars->start = get_time();
+		mvars->connect_time = mvars->auth_time = 0;
+		mvars->nboxes = 0;
 		mvars->boxes[M] = mvars->boxes[S] = mvars->cboxes = 0;
 		mvars->skip = mvars->cben = 0;
 		for (t = 0; t < 2; t++) {
@@ -648,6 +685,7 @@ sync_chans( main_vars_t *mvars, int ent )
 			mvars->skip = mvars->cben = 1;
 			return;
 		}
+		record_chan_stats( mvars );
 		free_string_list( mvars->cboxes );
 		free_string_list( mvars->boxes[M] );
 		free_string_list( mvars->boxes[S] );
@@ -677,6 +715,8 @@ store_opened( store_t *ctx, void *aux )
 		return;
 	}
 	mvars->ctx[t] = ctx;
+	mvars->connect_time += ctx->connect_time;
+	mvars->auth_time += ctx->auth_time;
 	if (mvars->skip) {
 		mvars->state[t] = ST_OPEN;
 		sync_chans( mvars, E_OPEN );
@@ -726,6 +766,7 @@ done_sync( int sts, void *aux )
 	main_vars_t *mvars = (main_vars_t *)aux;
 
 	mvars->done = 1;
+	mvars->nboxes++;
 	if (sts) {
 		mvars->ret = 1;
 		if (sts & (SYNC_BAD(M) | SYNC_BAD(S))) {
@@ -25,6 +25,13 @@ chdir "tmp" or die "Cannot enter temp direcory.\n";
 
 sub show($$@);
 sub test($$);
+sub test_state($$$$$);
+sub test_moves();
+sub test_recover();
+sub test_plan($$@);
+
+# whether mkbox() gives the messages Message-IDs
+my $msgids = 0;
 
 ################################################################################
 
@@ -134,6 +141,14 @@ my @X08 = (
 );
 test(\@x01, \@X08);
 
+# group and per-message fsync()ing
+
+my @X09 = (
+ [ "FSync Message\n", "FSync Batch\n", "" ],
+ @X01[1,2,3]
+);
+test(\@x01, \@X09);
+
 # size restriction tests
 
 my @x10 = (
@@ -232,6 +247,107 @@ my @X51 = (
 );
 test(\@x50, \@X51);
 
+# windowed sync tests
+
+#show("01", "61", "", "", "SyncWindow 3\n");
+my @X61 = (
+ [ "", "", "SyncWindow 3\n" ],
+ [ 10,
+   1, 1, "F", 2, 2, "F", 3, 3, "FS", 4, 4, "", 5, 5, "T", 6, 6, "FT", 7, 7, "FT", 9, 9, "", 10, 10, "" ],
+ [ 10,
+   1, 1, "F", 2, 2, "F", 3, 3, "FS", 4, 4, "", 5, 5, "T", 7, 7, "FT", 8, 8, "T", 9, 10, "", 10, 9, "" ],
+ [ 9, 0, 9,
+   1, 1, "F", 2, 2, "F", 3, 3, "FS", 4, 4, "", 5, 5, "T", 6, 0, "", 7, 7, "FT", 0, 8, "", 10, 9, "", 9, 10, "" ],
+);
+test(\@x01, \@X61);
+
+# boxes ending within the first window
+my @x62 = (
+ [ 9,
+   1, 1, "F", 2, 2, "", 3, 3, "FS", 4, 4, "", 5, 5, "T", 6, 6, "F", 7, 7, "FT", 9, 9, "" ],
+ [ 10,
+   1, 1, "", 2, 2, "F", 3, 3, "F", 4, 4, "", 5, 5, "", 7, 7, "", 8, 8, "", 10, 10, "" ],
+ [ 8, 0, 8,
+   1, 1, "", 2, 2, "", 3, 3, "", 4, 4, "", 5, 5, "", 6, 6, "", 7, 7, "", 8, 8, "" ],
+);
+
+#show("62", "63", "", "", "SyncWindow 20\n");
+my @X63 = (
+ [ "", "", "SyncWindow 20\n" ],
+ [ 10,
+   1, 1, "F", 2, 2, "F", 3, 3, "FS", 4, 4, "", 5, 5, "T", 6, 6, "FT", 7, 7, "FT", 9, 9, "", 10, 10, "" ],
+ [ 11,
+   1, 1, "F", 2, 2, "F", 3, 3, "FS", 4, 4, "", 5, 5, "T", 7, 7, "FT", 8, 8, "T", 10, 10, "", 9, 11, "" ],
+ [ 9, 0, 10,
+   1, 1, "F", 2, 2, "F", 3, 3, "FS", 4, 4, "", 5, 5, "T", 6, 0, "", 7, 7, "FT", 0, 8, "", 10, 10, "", 9, 11, "" ],
+);
+test(\@x62, \@X63);
+
+# recovery of copies whose UID was not recorded
+
+my @x70 = (
+ [ 2,
+   1, 1, "", 2, 2, "" ],
+ [ 2,
+   1, 1, "", 2, 2, "" ],
+ [ 2, 0, 1,
+   1, 1, "", 2, -2, "" ],
+);
+
+#show("70", "71", "", "", "");
+my @X71 = (
+ [ "", "", "" ],
+ [ 2,
+   1, 1, "", 2, 2, "" ],
+ [ 2,
+   1, 1, "", 2, 2, "" ],
+ [ 2, 0, 1,
+   1, 1, "", 2, 2, "" ],
+);
+$msgids = 1;
+test(\@x70, \@X71);
+
+# bulk import into an empty slave
+
+my @x80 = (
+ [ 4,
+   1, 1, "F", 2, 2, "", 3, 3, "S", 4, 4, "T" ],
+ [ 0 ],
+ [ ],
+);
+
+#show("80", "81", "", "", "");
+my @X81 = (
+ [ "", "", "" ],
+ [ 4,
+   1, 1, "F", 2, 2, "", 3, 3, "S", 4, 4, "T" ],
+ [ 4,
+   1, 1, "F", 2, 2, "", 3, 3, "S", 4, 4, "T" ],
+ [ 4, 0, 0,
+   1, 1, "F", 2, 2, "", 3, 3, "S", 4, 4, "T" ],
+);
+test(\@x80, \@X81);
+
+# moves between boxes
+
+test_moves();
+
+# re-pairing after a UIDVALIDITY change
+
+test_recover();
+$msgids = 0;
+
+# --plan
+
+test_plan(\@x01, "Expunge Both\n",
+	"  master: 1 new (68 bytes), 1 flag changes, 1 deletions, 0 to trash, 3 to expunge, 0 round trips\n",
+	"  slave: 1 new (67 bytes), 4 flag changes, 1 deletions, 0 to trash, 3 to expunge, 0 round trips\n");
+
+# sync state format tests
+
+test_state(\@x01, \@X01, "SyncStateFormat Binary\n", "slave/.mbsyncstate", "mbsyncst");
+test_state(\@x01, \@X01, "SyncStateLog 10000\n", "slave/.mbsyncstate.log", "2 ");
+
 
 ################################################################################
 
@@ -252,6 +368,76 @@ sub qm($)
 }
 
 # $global, $master, $slave
+sub test_recover()
+{
+	mkchan([ 3, 1, 1, "F", 2, 2, "", 3, 3, "S" ],
+	       [ 3, 1, 3, "F", 2, 1, "", 3, 2, "S" ],
+	       3, 0, 3, 1, 1, "F", 2, 2, "", 3, 3, "S");
+	close FILE;
+	open(FILE, ">", "slave/.uidvalidity") or
+		die "Cannot renumber slave.\n";
+	print FILE "2\n3\n";
+	close FILE;
+	&writecfg("", "", "RecoverUIDValidity yes\n");
+	my ($xc, @ret) = runsync("");
+	killcfg();
+	my $rslt = $xc || &ckbox("master", 3, 1, 1, "F", 2, 2, "", 3, 3, "S") ||
+	                  &ckbox("slave", 3, 1, 3, "F", 2, 1, "", 3, 2, "S");
+	if (!$rslt) {
+		open(FILE, "<", "slave/.mbsyncstate") or die "Cannot read sync state.\n";
+		my $st = join("", <FILE>);
+		close FILE;
+		if ($st ne "1:3 2:0:3\n1 3 F\n2 1 \n3 2 S\n") {
+			print STDERR "Sync state mismatch:\n$st";
+			$rslt = 1;
+		}
+	}
+	if ($rslt) {
+		print "Re-pairing messages after a UIDVALIDITY change failed.\n";
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+	rmtree "slave";
+	rmtree "master";
+}
+# \@input, $channel_options, @expected_plan
+sub test_plan($$@)
+{
+	my ($sx, $co, @plan) = @_;
+
+	mkchan($$sx[0], $$sx[1], @{ $$sx[2] });
+	&writecfg("", "", $co);
+	my ($xc, @ret) = runsync("-P");
+	killcfg();
+	my @got = grep(/^  (master|slave): \d+ new /, @ret);
+	my $rslt = $xc;
+	if (!$rslt && join("", @got) ne join("", @plan)) {
+		print STDERR "Plan mismatch:\n", @got;
+		$rslt = 1;
+	}
+	$rslt ||= ckstate("slave/.mbsyncstate", @{ $$sx[2] }) ||
+	           &ckbox("master", @{ $$sx[0] }) || &ckbox("slave", @{ $$sx[1] });
+	for my $f (".lock", ".journal", ".new", ".log") {
+		if (!$rslt && -e "slave/.mbsyncstate".$f) {
+			print STDERR "Planning left slave/.mbsyncstate$f behind.\n";
+			$rslt = 1;
+		}
+	}
+	if ($rslt) {
+		print "Input:\n";
+		printchan($$sx[0], $$sx[1], @{ $$sx[2] });
+		print "Options:\n";
+		print " [ \"\", \"\", \"".qm($co)."\" ]\n";
+		print "Expected plan:\n";
+		print @plan;
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+	rmtree "slave";
+	rmtree "master";
+}
 sub writecfg($$$)
 {
 	open(FILE, ">", ".mbsyncrc") or
@@ -441,7 +627,8 @@ sub mkbox($$@)
 		my $big = $flg =~ s/\*//;
 		open(FILE, ">", $bn."/cur/0.1_".$num.".local".$uid.":2,".$flg) or
 			die "Cannot create message $num in mailbox $bn.\n";
-		print FILE "From: foo\nTo: bar\nDate: Thu, 1 Jan 1970 00:00:00 +0000\nSubject: $num\n\n".(("A"x50)."\n")x($big*30);
+		print FILE "From: foo\nTo: bar\nDate: Thu, 1 Jan 1970 00:00:00 +0000\nSubject: $num\n".
+			($msgids ? "Message-ID: <$num\@local>\n" : "")."\n".(("A"x50)."\n")x($big*30);
 		close FILE;
 	}
 }
@@ -452,6 +639,7 @@ sub mkchan($$@)
 	my ($m, $s, @t) = @_;
 	&mkbox("master", @{ $m });
 	&mkbox("slave", @{ $s });
+	return if (!@t);
 	open(FILE, ">", "slave/.mbsyncstate") or
 		die "Cannot create sync state.\n";
 	print FILE "1:".shift(@t)." 1:".shift(@t).":".shift(@t)."\n";
@@ -633,3 +821,101 @@ sub test($$)
 	rmtree "slave";
 	rmtree "master";
 }
+
+# \@start, \@expected, $global, $file, $head
+# Sync with the extra global options, which must leave behind $file
+# starting with $head. A second run with the defaults must pick up the
+# state and write it out again unchanged.
+sub test_state($$$$$)
+{
+	my ($sx, $tx, $gl, $fn, $hd) = @_;
+
+	mkchan($$sx[0], $$sx[1], @{ $$sx[2] });
+	&writecfg($$tx[0][0], $$tx[0][1], $$tx[0][2]."\n".$gl);
+	my ($xc, @ret) = runsync("");
+	my $rslt = $xc;
+	if (!$rslt) {
+		$rslt |= &ckbox("master", @{ $$tx[1] });
+		$rslt |= &ckbox("slave", @{ $$tx[2] });
+		my $l;
+		if (!open(FILE, "<", $fn) or !defined($l = <FILE>) or substr($l, 0, length($hd)) ne $hd) {
+			print STDERR "Missing or wrong $fn.\n";
+			$rslt = 1;
+		}
+		close FILE;
+	}
+	if (!$rslt) {
+		&writecfg(@{ $$tx[0] });
+		($xc, @ret) = runsync("");
+		$rslt = $xc || ckstate("slave/.mbsyncstate", @{ $$tx[3] });
+	}
+	killcfg();
+	if ($rslt) {
+		print "Input:\n";
+		printchan($$sx[0], $$sx[1], @{ $$sx[2] });
+		print "Options:\n";
+		print " [ ".join(", ", map('"'.qm($_).'"', @{ $$tx[0] }, $gl))." ]\n";
+		print "Expected result:\n";
+		printchan($$tx[1], $$tx[2], @{ $$tx[3] });
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+	rmtree "slave";
+	rmtree "master";
+}
+
+# A message which was moved from box a to box b on the master must be
+# moved on the slave as well, rather than being deleted and copied anew.
+sub test_moves()
+{
+	mkdir "master";
+	mkdir "slave";
+	&mkbox("master/a", 1);
+	&mkbox("master/b", 2, 2, 1, "", 1, 2, "");
+	&mkbox("slave/a", 1, 1, 1, "");
+	&mkbox("slave/b", 1, 2, 1, "");
+	for my $bn ("slave/a", "slave/b") {
+		open(FILE, ">", $bn."/.mbsyncstate") or
+			die "Cannot create sync state.\n";
+		print FILE "1:1 1:0:1\n1 1 \n";
+		close FILE;
+	}
+	my $ino = (stat("slave/a/cur/0.1_1.local,U=1:2,"))[1];
+	open(FILE, ">", ".mbsyncrc") or
+		die "Cannot open .mbsyncrc.\n";
+	print FILE
+"MaildirStore master
+Path ./master/
+
+MaildirStore slave
+Path ./slave/
+
+Channel test
+Master :master:
+Slave :slave:
+Patterns a b
+SyncState *
+Expunge Both
+DetectMoves yes
+";
+	close FILE;
+	my ($xc, @ret) = runsync("");
+	killcfg();
+	my $rslt = $xc || &ckbox("slave/a", 1) || &ckbox("slave/b", 2, 2, 1, "", 1, 2, "");
+	if (!$rslt) {
+		my @fs = (glob("slave/b/cur/*,U=2:*"), glob("slave/b/new/*,U=2:*"));
+		if (@fs != 1 or (stat($fs[0]))[1] != $ino) {
+			print STDERR "Moved message was copied instead.\n";
+			$rslt = 1;
+		}
+	}
+	if ($rslt) {
+		print "Moving a message from box a to box b failed.\n";
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+	rmtree "slave";
+	rmtree "master";
+}
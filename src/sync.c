@@ -33,6 +33,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 const char *str_ms[] = { "master", "slave" }, *str_hl[] = { "push", "pull" };
 
@@ -96,6 +97,7 @@ make_flags( int flags, char *buf )
 #define S_EXPIRE       (1<<5)
 #define S_NEXPIRE      (1<<6)
 #define S_EXP_S        (1<<7)
+#define S_INWIN        (1<<8) /* handled by the current pass of a windowed sync */
 
 #define mvBit(in,ib,ob) ((unsigned char)(((unsigned)in) * (ob) / (ib)))
 
@@ -104,10 +106,29 @@ typedef struct sync_rec {
 	/* string_list_t *keywords; */
 	int uid[2];
 	message_t *msg[2];
-	unsigned char status, flags, aflags[2], dflags[2];
-	char tuid[TUIDL];
+	unsigned short status;
+	unsigned char flags, aflags[2], dflags[2];
+	char *tuid; /* TUIDL chars, not terminated; null if none */
 } sync_rec_t;
 
+/* Sync records are carved out of big chunks in the order they are linked
+   into the list, so walking the list walks memory sequentially. TUIDs are
+   needed only for messages in flight, so they live in chunks of their own. */
+#define SREC_CHUNK 1024
+#define TUID_CHUNK 256
+
+typedef struct srec_chunk {
+	struct srec_chunk *next;
+	int used;
+	sync_rec_t recs[SREC_CHUNK];
+} srec_chunk_t;
+
+typedef struct tuid_chunk {
+	struct tuid_chunk *next;
+	int used;
+	char tuids[TUID_CHUNK][TUIDL];
+} tuid_chunk_t;
+
 
 /* cases:
    a) both non-null
@@ -136,12 +157,39 @@ typedef struct sync_rec {
    impossible cases: both uid[M] & uid[S] 0 or -1, both not scanned
 */
 
+/* max. number of stored messages whose UIDs are journalled in one go */
+#define MAX_PEND_UIDS 100
+
+typedef struct {
+	sync_rec_t *srec;
+	int uid;
+} pend_uid_t;
+
+/* phases timed for the StatsFile */
+#define PH_SELECT  0
+#define PH_LIST    1
+#define PH_MATCH   2
+#define PH_COPY    3
+#define PH_FLAGS   4
+#define PH_TRASH   5
+#define PH_CLOSE   6
+#define PH_STATE   7
+#define PH_COUNT   8
+
+/* What a run would do to one side, as counted in --plan mode. */
+typedef struct {
+	unsigned long bytes;
+	int nnew, nflags, ndel, ntrash, nexp, rtts;
+} plan_t;
+
 typedef struct {
 	int t[2];
 	void (*cb)( int sts, void *aux ), *aux;
-	char *dname, *jname, *nname, *lname;
+	char *dname, *jname, *nname, *lname, *logname;
 	FILE *jfp, *nfp;
 	sync_rec_t *srecs, **srecadd, **osrecadd;
+	srec_chunk_t *schunks, *lschunk;
+	tuid_chunk_t *tchunks;
 	channel_conf_t *chan;
 	store_t *ctx[2];
 	driver_t *drv[2];
@@ -152,7 +200,24 @@ typedef struct {
 	int flags_total[2], flags_done[2];
 	int trash_total[2], trash_done[2];
 	int maxuid[2], uidval[2], smaxxuid, lfd;
-	unsigned find:1;
+	pend_uid_t *pend[2]; /* stored, but not yet committed messages */
+	int npend[2];
+	struct copy_vars *copyq, **copyqadd, *pfnext; /* messages waiting to be copied */
+	int npf; /* # of messages fetched ahead */
+	size_t pfbytes;
+	ino_t bino; /* identifies the base state the log applies to */
+	off_t bsize;
+	int recover; /* mask of sides whose UIDVALIDITY changed */
+	int window, wpass, wdone; /* UIDs per pass, passes so far, mask of sides done */
+	int wlo[2], whi[2]; /* UIDs covered by the current pass */
+	int *wnext; /* set by the finished pass to start the next one */
+	double ptime[PH_COUNT], pbegin[PH_COUNT], sbegin[2];
+	unsigned long bytes[2]; /* fetched for storing on the respective side */
+	plan_t plan[2]; /* what --plan counted for the respective side */
+	unsigned find:1, logged:1, logmode:1, recovering:1;
+	unsigned fresh:1; /* there is no sync state yet */
+	unsigned bulk:1; /* importing into an empty slave; see msgs_matched() */
+	unsigned lost:1; /* there are copies of unknown UID; see match_lost_copies() */
 } sync_vars_t;
 
 #define AUX &svars->t[t]
@@ -180,16 +245,127 @@ typedef struct {
 #define ST_SENT_TRASH      (1<<4)
 #define ST_CLOSED          (1<<5)
 #define ST_CANCELED        (1<<6)
+#define ST_LOADED_MSGIDS   (1<<7)
 
 #define ST_DID_EXPUNGE     (1<<16)
 
+/* Append a zeroed sync record to the list. */
+static sync_rec_t *
+new_srec( sync_vars_t *svars )
+{
+	srec_chunk_t *sc;
+	sync_rec_t *srec;
+
+	if (!(sc = svars->lschunk) || sc->used == SREC_CHUNK) {
+		sc = nfmalloc( sizeof(*sc) );
+		sc->next = 0;
+		sc->used = 0;
+		if (svars->lschunk)
+			svars->lschunk->next = sc;
+		else
+			svars->schunks = sc;
+		svars->lschunk = sc;
+	}
+	srec = &sc->recs[sc->used++];
+	memset( srec, 0, sizeof(*srec) );
+	*svars->srecadd = srec;
+	svars->srecadd = &srec->next;
+	return srec;
+}
+
+static char *
+new_tuid( sync_vars_t *svars )
+{
+	tuid_chunk_t *tc;
+
+	if (!(tc = svars->tchunks) || tc->used == TUID_CHUNK) {
+		tc = nfmalloc( sizeof(*tc) );
+		tc->next = svars->tchunks;
+		tc->used = 0;
+		svars->tchunks = tc;
+	}
+	return tc->tuids[tc->used++];
+}
+
+/* Squeeze out the dead records. As the list is in allocation order, the
+   live ones can be moved down in place. Nothing may point at the records
+   then, so this is done only right after loading the state and between
+   the passes of a windowed sync, when no operations are in flight and the
+   messages of the previous pass are not looked at anymore. */
+static void
+compact_srecs( sync_vars_t *svars )
+{
+	srec_chunk_t *rc, *wc, *nc;
+	sync_rec_t *srec, *dst;
+	int ri, wi;
+
+	if (!(wc = svars->schunks))
+		return;
+	wi = 0;
+	svars->srecadd = &svars->srecs;
+	for (rc = svars->schunks; rc; rc = rc->next)
+		for (ri = 0; ri < rc->used; ri++) {
+			srec = &rc->recs[ri];
+			if (srec->status & S_DEAD)
+				continue;
+			if (wi == SREC_CHUNK) {
+				wc->used = wi;
+				wc = wc->next;
+				wi = 0;
+			}
+			dst = &wc->recs[wi++];
+			if (dst != srec)
+				*dst = *srec;
+			*svars->srecadd = dst;
+			svars->srecadd = &dst->next;
+		}
+	*svars->srecadd = 0;
+	wc->used = wi;
+	for (rc = wc->next; rc; rc = nc) {
+		nc = rc->next;
+		free( rc );
+	}
+	wc->next = 0;
+	svars->lschunk = wc;
+}
+
+/* Phases which run concurrently on both sides span from their first
+   start to their last end. */
+static void
+phase_begin( sync_vars_t *svars, int ph )
+{
+	if (!svars->pbegin[ph])
+		svars->pbegin[ph] = get_time();
+}
+
+static void
+phase_end( sync_vars_t *svars, int ph )
+{
+	svars->ptime[ph] = get_time() - svars->pbegin[ph];
+}
+
+/* The journal is buffered; it must be flushed before any driver operation
+   which relies on the entries written so far being on record. */
+static void
+jflush( sync_vars_t *svars )
+{
+	if (fflush( svars->jfp ) == EOF ||
+	    (global_state_fsync && fsync( fileno( svars->jfp ) )))
+	{
+		perror( "cannot write journal" );
+		exit( 1 );
+	}
+}
+
 
 typedef struct copy_vars {
+	struct copy_vars *next;
 	int (*cb)( int sts, int uid, struct copy_vars *vars );
 	void *aux;
 	sync_rec_t *srec; /* also ->tuid */
 	message_t *msg;
 	msg_data_t data;
+	int tagged; /* the copy carries an X-TUID header */
 } copy_vars_t;
 
 static int msg_fetched( int sts, void *aux );
@@ -200,20 +376,118 @@ copy_msg( copy_vars_t *vars )
 	SVARS(vars->aux)
 
 	vars->data.flags = vars->msg->flags;
+	/* Without line ending conversion, the body can be passed through as-is. */
+	vars->data.want_tail = (svars->drv[1-t]->flags & svars->drv[t]->flags & DRV_FDCOPY) &&
+	                       !((svars->drv[1-t]->flags ^ svars->drv[t]->flags) & DRV_CRLF);
+	vars->data.size = 0;
+	vars->data.verbatim = 0;
+	vars->data.tail_fd = -1;
+	vars->data.tail_len = 0;
 	return svars->drv[1-t]->fetch_msg( svars->ctx[1-t], vars->msg, &vars->data, msg_fetched, vars );
 }
 
+/* max. number of messages and bytes fetched ahead while copying */
+#define COPY_WINDOW 32
+#define COPY_WINDOW_BYTES (4 * 1024 * 1024)
+
+/* Copy the queued messages, keeping a window of fetches in flight, so
+   the source can deliver while we are still storing. */
+static int
+copy_queued( sync_vars_t *svars, int t )
+{
+	copy_vars_t *cv;
+
+	/* Bulk copies do not flush the journal themselves. */
+	jflush( svars );
+	svars->pfnext = svars->copyq;
+	while ((cv = svars->copyq)) {
+		while (svars->pfnext &&
+		       (!svars->npf || (svars->npf < COPY_WINDOW &&
+		                        svars->pfbytes + svars->pfnext->msg->size <= COPY_WINDOW_BYTES))) {
+			svars->drv[1-t]->prefetch_msg( svars->ctx[1-t], svars->pfnext->msg );
+			svars->npf++;
+			svars->pfbytes += svars->pfnext->msg->size;
+			svars->pfnext = svars->pfnext->next;
+		}
+		if (!(svars->copyq = cv->next))
+			svars->copyqadd = &svars->copyq;
+		svars->npf--;
+		svars->pfbytes -= cv->msg->size;
+		if (copy_msg( cv ))
+			return 1;
+	}
+	return 0;
+}
+
 static int msg_stored( int sts, int uid, void *aux );
 
+static void
+queue_copy( sync_vars_t *svars, copy_vars_t *cv )
+{
+	cv->next = 0;
+	*svars->copyqadd = cv;
+	svars->copyqadd = &cv->next;
+}
+
+/* A message expunged from a previously synced box may be moved over
+   instead of being copied. */
+static int
+msg_adopted( int sts, int uid, void *aux )
+{
+	copy_vars_t *vars = (copy_vars_t *)aux;
+	SVARS(vars->aux)
+
+	if (sts == DRV_MSG_BAD) {
+		queue_copy( svars, vars );
+		return 0;
+	}
+	if (sts == DRV_OK)
+		debug( "  -> moved from another box, UID %d\n", uid );
+	return msg_stored( sts, uid, aux );
+}
+
+/* Convert the line endings of a message tail which was spilled to a file
+   into a new spill file, which then replaces the old one. */
+static int
+conv_tail( msg_data_t *data, int cra, int crd )
+{
+	char *ibuf, *obuf;
+	off_t off = data->tail_off;
+	int fd, n, o, left = data->tail_len, out = 0;
+
+	if ((fd = spill_file()) < 0)
+		return -1;
+	ibuf = nfmalloc( TAIL_CHUNK * 3 );
+	obuf = ibuf + TAIL_CHUNK;
+	for (; left; left -= n, off += n, out += o) {
+		if ((n = pread( data->tail_fd, ibuf, left < TAIL_CHUNK ? left : TAIL_CHUNK, off )) <= 0)
+			goto bail;
+		o = conv_copy( obuf, ibuf, n, cra, crd );
+		if (write( fd, obuf, o ) != o)
+			goto bail;
+	}
+	free( ibuf );
+	close( data->tail_fd );
+	data->tail_fd = fd;
+	data->tail_off = 0;
+	data->tail_len = out;
+	return 0;
+
+  bail:
+	perror( "Error: cannot convert spilled message" );
+	free( ibuf );
+	close( fd );
+	return -1;
+}
+
 static int
 msg_fetched( int sts, void *aux )
 {
 	copy_vars_t *vars = (copy_vars_t *)aux;
 	SVARS(vars->aux)
+	const char *p, *tuid;
 	char *fmap, *buf;
-	int i, len, extra, cra, crd, scr, tcr, crds;
-	int start, sbreak = 0, ebreak = 0;
-	char c;
+	int i, len, room, cra, crd, scr, tcr, sbreak, ebreak, tl, hl, nt, out;
 
 	switch (sts) {
 	case DRV_OK:
@@ -221,94 +495,95 @@ msg_fetched( int sts, void *aux )
 
 		scr = (svars->drv[1-t]->flags / DRV_CRLF) & 1;
 		tcr = (svars->drv[t]->flags / DRV_CRLF) & 1;
-		if (vars->srec || scr != tcr) {
+		/* Targets which report the UIDs of new messages get verbatim
+		   copies; the TUID is on record only then. */
+		tuid = vars->srec && !svars->ctx[t]->uidplus ? vars->srec->tuid : 0;
+		vars->tagged = tuid != 0;
+		if (tuid || scr != tcr) {
 			fmap = vars->data.data;
 			len = vars->data.len;
-			cra = crd = 0;
-			if (scr > tcr)
-				crd = -1;
-			else if (scr < tcr)
-				cra = 1;
-			extra = 0, i = 0;
-			if (vars->srec) {
-				extra += 8 + TUIDL + 1 + tcr;
-			  nloop:
-				start = i;
-				crds = 0;
-				while (i < len) {
-					c = fmap[i++];
-					if (c == '\r')
-						crds += crd;
-					else if (c == '\n') {
-						if (!memcmp( fmap + start, "X-TUID: ", 8 )) {
-							extra -= (ebreak = i) - (sbreak = start);
-							goto oke;
-						}
-						extra += cra + crds;
-						if (i - 1 - scr == start) {
-							sbreak = ebreak = i - 1 - scr;
-							goto oke;
-						}
-						goto nloop;
-					}
-				}
-				/* invalid message */
+			room = vars->data.size > len ? vars->data.size : len;
+			cra = scr < tcr;
+			crd = scr > tcr;
+			if (vars->data.tail_len && (cra || crd) && conv_tail( &vars->data, cra, crd )) {
 				free( fmap );
-				return vars->cb( SYNC_NOGOOD, 0, vars );
+				close( vars->data.tail_fd );
+				return vars->cb( SYNC_FAIL, 0, vars );
 			}
-		  oke:
-			if (cra || crd)
-				for (; i < len; i++) {
-					c = fmap[i];
-					if (c == '\r')
-						extra += crd;
-					else if (c == '\n')
-						extra += cra;
+			/* The X-TUID goes in place of an existing one or at the end of the header. */
+			sbreak = ebreak = tl = 0;
+			if (tuid) {
+				for (i = 0; ; i = ebreak) {
+					if (!(p = memchr( fmap + i, '\n', len - i ))) {
+						/* invalid message */
+						free( fmap );
+						if (vars->data.tail_fd >= 0)
+							close( vars->data.tail_fd );
+						return vars->cb( SYNC_NOGOOD, 0, vars );
+					}
+					sbreak = i;
+					ebreak = p - fmap + 1;
+					if (ebreak - i >= 8 && !memcmp( fmap + i, "X-TUID: ", 8 ))
+						break;
+					if (ebreak - 1 - scr == i) {
+						ebreak = i; /* keep the empty line */
+						break;
+					}
 				}
-
-			vars->data.len = len + extra;
-			buf = vars->data.data = nfmalloc( vars->data.len );
-			i = 0;
-			if (vars->srec) {
+				tl = 8 + TUIDL + 1 + tcr;
+			}
+			/* Size of the converted part before the X-TUID, and of the
+			   whole message if it is known already. */
+			nt = 0;
+			if (cra) {
+				hl = sbreak + count_chr( fmap, sbreak, '\n' );
+				nt = count_chr( fmap + ebreak, len - ebreak, '\n' );
+			} else if (crd)
+				hl = sbreak - count_chr( fmap, sbreak, '\r' );
+			else
+				hl = sbreak;
+			out = hl + tl + len - ebreak + nt;
+
+			/* Rewrite in place if the result fits; only CR removal
+			   can make it smaller than estimated. */
+			if (cra ? (out <= room && hl + tl >= ebreak) : (hl + tl <= ebreak || out <= room)) {
+				buf = fmap;
 				if (cra) {
-					for (; i < sbreak; i++) {
-						if (fmap[i] == '\n')
-							*buf++ = '\r';
-						*buf++ = fmap[i];
-					}
-				} else if (crd) {
-					for (; i < sbreak; i++)
-						if (fmap[i] != '\r')
-							*buf++ = fmap[i];
+					conv_copy_back( buf, ebreak, len - ebreak, hl + tl, nt );
+					conv_copy_back( buf, 0, sbreak, 0, hl - sbreak );
+					i = out;
 				} else {
-					memcpy( buf, fmap, sbreak );
-					buf += sbreak;
+					conv_copy( buf, fmap, sbreak, 0, crd );
+					if (hl + tl > ebreak) {
+						memmove( buf + hl + tl, fmap + ebreak, len - ebreak );
+						len += hl + tl - ebreak;
+						ebreak = hl + tl;
+					}
+					i = hl + tl + conv_copy( buf + hl + tl, fmap + ebreak, len - ebreak, 0, crd );
 				}
-				memcpy( buf, "X-TUID: ", 8 );
-				buf += 8;
-				memcpy( buf, vars->srec->tuid, TUIDL );
-				buf += TUIDL;
+			} else {
+				buf = nfmalloc( room = out );
+				conv_copy( buf, fmap, sbreak, cra, crd );
+				i = hl + tl + conv_copy( buf + hl + tl, fmap + ebreak, len - ebreak, cra, crd );
+				free( fmap );
+			}
+			if (tuid) {
+				memcpy( buf + hl, "X-TUID: ", 8 );
+				memcpy( buf + hl + 8, tuid, TUIDL );
 				if (tcr)
-					*buf++ = '\r';
-				*buf++ = '\n';
-				i = ebreak;
+					buf[hl + 8 + TUIDL] = '\r';
+				buf[hl + tl - 1] = '\n';
 			}
-			if (cra) {
-				for (; i < len; i++) {
-					if (fmap[i] == '\n')
-						*buf++ = '\r';
-					*buf++ = fmap[i];
-				}
-			} else if (crd) {
-				for (; i < len; i++)
-					if (fmap[i] != '\r')
-						*buf++ = fmap[i];
-			} else
-				memcpy( buf, fmap + i, len - i );
-
-			free( fmap );
+			vars->data.data = buf;
+			vars->data.len = i;
+			vars->data.size = room;
+			vars->data.verbatim = 0;
 		}
 
+		svars->bytes[t] += vars->data.len + vars->data.tail_len;
+		/* The TUID must be on record before the copy exists. */
+		if (vars->srec && vars->srec->tuid)
+			jflush( svars );
 		return svars->drv[t]->store_msg( svars->ctx[t], &vars->data, !vars->srec, msg_stored, vars );
 	case DRV_CANCELED:
 		return vars->cb( SYNC_CANCELED, 0, vars );
@@ -396,7 +671,8 @@ cancel_done( int sts, void *aux )
 	}
 	svars->state[t] |= ST_CANCELED;
 	if (svars->state[1-t] & ST_CANCELED) {
-		Fclose( svars->nfp );
+		if (svars->nfp)
+			Fclose( svars->nfp );
 		Fclose( svars->jfp );
 		sync_bail( svars );
 	}
@@ -447,20 +723,418 @@ clean_strdup( const char *s )
 
 #define JOURNAL_VERSION "2"
 
+/* Index of the sync records by UID pair, used while replaying the journal. */
+typedef struct srec_node {
+	struct srec_node *next;
+	sync_rec_t *srec;
+} srec_node_t;
+
+typedef struct {
+	srec_node_t **buckets;
+	int size, count;
+} srec_hash_t;
+
+static unsigned
+srec_hash_val( int muid, int suid )
+{
+	unsigned h = (unsigned)muid * 0x9e3779b1U ^ (unsigned)suid;
+
+	return h ^ (h >> 15);
+}
+
+static void
+srec_hash_link( srec_hash_t *hash, srec_node_t *node )
+{
+	srec_node_t **bucket = &hash->buckets[srec_hash_val( node->srec->uid[M], node->srec->uid[S] ) & (hash->size - 1)];
+
+	node->next = *bucket;
+	*bucket = node;
+}
+
+static void
+srec_hash_add( srec_hash_t *hash, sync_rec_t *srec )
+{
+	srec_node_t *node, *nnode, **obuckets;
+	int i, osize;
+
+	if (hash->count >= hash->size) {
+		obuckets = hash->buckets;
+		osize = hash->size;
+		hash->size = osize ? osize * 2 : 1024;
+		hash->buckets = nfcalloc( hash->size * sizeof(*hash->buckets) );
+		for (i = 0; i < osize; i++)
+			for (node = obuckets[i]; node; node = nnode) {
+				nnode = node->next;
+				srec_hash_link( hash, node );
+			}
+		free( obuckets );
+	}
+	node = nfmalloc( sizeof(*node) );
+	node->srec = srec;
+	srec_hash_link( hash, node );
+	hash->count++;
+}
+
+/* Newer entries shadow older ones; dead ones are found only as a last resort. */
+static sync_rec_t *
+srec_hash_find( srec_hash_t *hash, int muid, int suid )
+{
+	srec_node_t *node;
+	sync_rec_t *dead = 0;
+
+	if (!hash->size)
+		return 0;
+	for (node = hash->buckets[srec_hash_val( muid, suid ) & (hash->size - 1)]; node; node = node->next)
+		if (node->srec->uid[M] == muid && node->srec->uid[S] == suid) {
+			if (!(node->srec->status & S_DEAD))
+				return node->srec;
+			if (!dead)
+				dead = node->srec;
+		}
+	return dead;
+}
+
+/* To be called before changing the UIDs of srec. */
+static void
+srec_hash_unlink( srec_hash_t *hash, sync_rec_t *srec )
+{
+	srec_node_t *node, **nodep;
+
+	for (nodep = &hash->buckets[srec_hash_val( srec->uid[M], srec->uid[S] ) & (hash->size - 1)];
+	     (node = *nodep); nodep = &node->next)
+		if (node->srec == srec) {
+			*nodep = node->next;
+			free( node );
+			hash->count--;
+			return;
+		}
+}
+
+static void
+srec_hash_free( srec_hash_t *hash )
+{
+	srec_node_t *node, *nnode;
+	int i;
+
+	for (i = 0; i < hash->size; i++)
+		for (node = hash->buckets[i]; node; node = nnode) {
+			nnode = node->next;
+			free( node );
+		}
+	free( hash->buckets );
+}
+
+/* Binary sync state: a header followed by fixed-size records, all in host
+   byte order. The checksum covers the header (with csum being zero) and the
+   records. */
+#define BSTATE_MAGIC "mbsyncst"
+#define BSTATE_VERSION 1
+
+typedef struct {
+	char magic[8];
+	unsigned version, count, csum;
+	int uidval[2], maxuid[2], smaxxuid;
+} bstate_hdr_t;
+
+typedef struct {
+	int uid[2];
+	unsigned char flags, expired, pad[2];
+} bstate_rec_t;
+
+static unsigned
+bstate_csum( unsigned h, const void *data, size_t len )
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+static sync_rec_t *
+add_srec( sync_vars_t *svars, int muid, int suid, int flags, int expired )
+{
+	sync_rec_t *srec;
+
+	srec = new_srec( svars );
+	srec->uid[M] = muid;
+	srec->uid[S] = suid;
+	srec->status = expired ? S_EXPIRE | S_EXPIRED : 0;
+	srec->flags = flags;
+	debug( "  entry (%d,%d,%u,%s)\n", srec->uid[M], srec->uid[S], srec->flags, srec->status & S_EXPIRED ? "X" : "" );
+	return srec;
+}
+
+static int
+load_state_text( sync_vars_t *svars, FILE *fp )
+{
+	char *s;
+	int line, t, t1, t2;
+	char fbuf[16]; /* enlarge when support for keywords is added */
+	char buf[64];
+
+	if (!fgets( buf, sizeof(buf), fp ) || !(t = strlen( buf )) || buf[t - 1] != '\n') {
+		error( "Error: incomplete sync state header in %s\n", svars->dname );
+		return 0;
+	}
+	if (sscanf( buf, "%d:%d %d:%d:%d", &svars->uidval[M], &svars->maxuid[M], &svars->uidval[S], &svars->smaxxuid, &svars->maxuid[S]) != 5) {
+		error( "Error: invalid sync state header in %s\n", svars->dname );
+		return 0;
+	}
+	line = 1;
+	while (fgets( buf, sizeof(buf), fp )) {
+		line++;
+		if (!(t = strlen( buf )) || buf[t - 1] != '\n') {
+			error( "Error: incomplete sync state entry at %s:%d\n", svars->dname, line );
+			return 0;
+		}
+		fbuf[0] = 0;
+		if (sscanf( buf, "%d %d %15s", &t1, &t2, fbuf ) < 2) {
+			error( "Error: invalid sync state entry at %s:%d\n", svars->dname, line );
+			return 0;
+		}
+		s = fbuf;
+		if (*s == 'X')
+			s++;
+		add_srec( svars, t1, t2, parse_flags( s ), s != fbuf );
+	}
+	return 1;
+}
+
+static int
+load_state_binary( sync_vars_t *svars, int fd, off_t size )
+{
+	const bstate_hdr_t *hdr;
+	const bstate_rec_t *recs;
+	bstate_hdr_t chdr;
+	void *map;
+	unsigned i;
+	int ret = 0;
+
+	if (size < (off_t)sizeof(*hdr)) {
+		error( "Error: incomplete sync state header in %s\n", svars->dname );
+		return 0;
+	}
+	if ((map = mmap( 0, size, PROT_READ, MAP_PRIVATE, fd, 0 )) == MAP_FAILED) {
+		error( "Error: cannot map sync state %s: %s\n", svars->dname, strerror(errno) );
+		return 0;
+	}
+	hdr = map;
+	recs = (const bstate_rec_t *)(hdr + 1);
+	if (hdr->version != BSTATE_VERSION) {
+		error( "Error: unsupported sync state version %u in %s\n", hdr->version, svars->dname );
+		goto bail;
+	}
+	if ((size_t)size != sizeof(*hdr) + (size_t)hdr->count * sizeof(*recs)) {
+		error( "Error: sync state %s has wrong size\n", svars->dname );
+		goto bail;
+	}
+	chdr = *hdr;
+	chdr.csum = 0;
+	if (bstate_csum( bstate_csum( 2166136261U, &chdr, sizeof(chdr) ), recs, hdr->count * sizeof(*recs) ) != hdr->csum) {
+		error( "Error: sync state %s is corrupted\n", svars->dname );
+		goto bail;
+	}
+	svars->uidval[M] = hdr->uidval[M];
+	svars->maxuid[M] = hdr->maxuid[M];
+	svars->uidval[S] = hdr->uidval[S];
+	svars->maxuid[S] = hdr->maxuid[S];
+	svars->smaxxuid = hdr->smaxxuid;
+	for (i = 0; i < hdr->count; i++)
+		add_srec( svars, recs[i].uid[M], recs[i].uid[S], recs[i].flags, recs[i].expired );
+	ret = 1;
+  bail:
+	munmap( map, size );
+	return ret;
+}
+
+static void
+write_state_binary( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	bstate_hdr_t *hdr;
+	bstate_rec_t *rec;
+	unsigned count;
+	size_t len;
+
+	for (count = 0, srec = svars->srecs; srec; srec = srec->next)
+		if (!(srec->status & S_DEAD))
+			count++;
+	len = sizeof(*hdr) + count * sizeof(*rec);
+	hdr = nfcalloc( len );
+	memcpy( hdr->magic, BSTATE_MAGIC, sizeof(hdr->magic) );
+	hdr->version = BSTATE_VERSION;
+	hdr->count = count;
+	hdr->uidval[M] = svars->uidval[M];
+	hdr->maxuid[M] = svars->maxuid[M];
+	hdr->uidval[S] = svars->uidval[S];
+	hdr->maxuid[S] = svars->maxuid[S];
+	hdr->smaxxuid = svars->smaxxuid;
+	rec = (bstate_rec_t *)(hdr + 1);
+	for (srec = svars->srecs; srec; srec = srec->next) {
+		if (srec->status & S_DEAD)
+			continue;
+		rec->uid[M] = srec->uid[M];
+		rec->uid[S] = srec->uid[S];
+		rec->flags = srec->flags;
+		rec->expired = (srec->status & S_EXPIRED) != 0;
+		rec++;
+	}
+	hdr->csum = bstate_csum( 2166136261U, hdr, len );
+	if (fwrite( hdr, len, 1, svars->nfp ) != 1) {
+		perror( "cannot write file" );
+		exit( 1 );
+	}
+	free( hdr );
+}
+
+/* Replay the journal entries following the header onto the sync records. */
+static int
+load_journal( sync_vars_t *svars, FILE *jfp, const char *jname )
+{
+	sync_rec_t *srec;
+	srec_hash_t hash;
+	int line, t, t1, t2, t3;
+	char buf[64];
+
+	memset( &hash, 0, sizeof(hash) );
+	for (srec = svars->srecs; srec; srec = srec->next)
+		srec_hash_add( &hash, srec );
+	line = 1;
+	while (fgets( buf, sizeof(buf), jfp )) {
+		line++;
+		if (!(t = strlen( buf )) || buf[t - 1] != '\n') {
+			error( "Error: incomplete journal entry at %s:%d\n", jname, line );
+			srec_hash_free( &hash );
+			return 0;
+		}
+		if (buf[0] == '#' ?
+		      (t3 = 0, (sscanf( buf + 2, "%d %d %n", &t1, &t2, &t3 ) < 2) || !t3 || (t - t3 != TUIDL + 3)) :
+		      buf[0] == '(' || buf[0] == ')' ?
+		        (sscanf( buf + 2, "%d", &t1 ) != 1) :
+		        buf[0] == '+' || buf[0] == '&' || buf[0] == '-' || buf[0] == '|' || buf[0] == '/' || buf[0] == '\\' ?
+		          (sscanf( buf + 2, "%d %d", &t1, &t2 ) != 2) :
+		          (sscanf( buf + 2, "%d %d %d", &t1, &t2, &t3 ) != 3))
+		{
+			error( "Error: malformed journal entry at %s:%d\n", jname, line );
+			srec_hash_free( &hash );
+			return 0;
+		}
+		if (buf[0] == '(')
+			svars->maxuid[M] = t1;
+		else if (buf[0] == ')')
+			svars->maxuid[S] = t1;
+		else if (buf[0] == '|') {
+			svars->uidval[M] = t1;
+			svars->uidval[S] = t2;
+		} else if (buf[0] == '+') {
+			srec = new_srec( svars );
+			srec->uid[M] = t1;
+			srec->uid[S] = t2;
+			debug( "  new entry(%d,%d)\n", t1, t2 );
+			srec_hash_add( &hash, srec );
+		} else {
+			if (!(srec = srec_hash_find( &hash, t1, t2 ))) {
+				error( "Error: journal entry at %s:%d refers to non-existing sync state entry\n", jname, line );
+				srec_hash_free( &hash );
+				return 0;
+			}
+			debugn( "  entry(%d,%d,%u) ", srec->uid[M], srec->uid[S], srec->flags );
+			switch (buf[0]) {
+			case '-':
+				debug( "killed\n" );
+				srec->status = S_DEAD;
+				break;
+			case '#':
+				debug( "TUID now %." stringify(TUIDL) "s\n", buf + t3 + 2 );
+				if (!srec->tuid)
+					srec->tuid = new_tuid( svars );
+				memcpy( srec->tuid, buf + t3 + 2, TUIDL );
+				break;
+			case '&':
+				debug( "TUID %." stringify(TUIDL) "s lost\n", srec->tuid ? srec->tuid : "" );
+				srec->flags = 0;
+				srec->tuid = 0;
+				break;
+			case '<':
+				debug( "master now %d\n", t3 );
+				srec_hash_unlink( &hash, srec );
+				srec->uid[M] = t3;
+				srec->tuid = 0;
+				srec_hash_add( &hash, srec );
+				break;
+			case '>':
+				debug( "slave now %d\n", t3 );
+				srec_hash_unlink( &hash, srec );
+				srec->uid[S] = t3;
+				srec->tuid = 0;
+				srec_hash_add( &hash, srec );
+				break;
+			case '*':
+				debug( "flags now %d\n", t3 );
+				srec->flags = t3;
+				break;
+			case '~':
+				debug( "expire now %d\n", t3 );
+				if (t3)
+					srec->status |= S_EXPIRE;
+				else
+					srec->status &= ~S_EXPIRE;
+				break;
+			case '\\':
+				t3 = (srec->status & S_EXPIRED);
+				debug( "expire back to %d\n", t3 / S_EXPIRED );
+				if (t3)
+					srec->status |= S_EXPIRE;
+				else
+					srec->status &= ~S_EXPIRE;
+				break;
+			case '/':
+				t3 = (srec->status & S_EXPIRE);
+				debug( "expired now %d\n", t3 / S_EXPIRE );
+				if (t3) {
+					if (svars->smaxxuid < srec->uid[S])
+						svars->smaxxuid = srec->uid[S];
+					srec->status |= S_EXPIRED;
+				} else
+					srec->status &= ~S_EXPIRED;
+				break;
+			default:
+				error( "Error: unrecognized journal entry at %s:%d\n", jname, line );
+				srec_hash_free( &hash );
+				return 0;
+			}
+		}
+	}
+	srec_hash_free( &hash );
+	return 1;
+}
+
 static int select_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nmexcs );
+static int trash_expunged( sync_vars_t *svars, int t );
+static void run_windows( sync_vars_t *svars );
+
+/* Whether messages of side t need line counts to be compared with the
+   other side by size; see sizes_match(). */
+static int
+lines_opt( sync_vars_t *svars, int t )
+{
+	return ((svars->drv[M]->flags ^ svars->drv[S]->flags) & DRV_CRLF) &&
+	       !(svars->drv[t]->flags & DRV_CRLF) ? OPEN_LINES : 0;
+}
 
 void
 sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
             void (*cb)( int sts, void *aux ), void *aux )
 {
 	sync_vars_t *svars;
-	sync_rec_t *srec, *nsrec;
+	sync_rec_t *srec;
 	char *s, *cmname, *csname;
 	FILE *jfp;
-	int opts[2], line, t1, t2, t3, t;
+	unsigned long ino;
+	int opts[2], line, t, fd;
 	struct stat st;
 	struct flock lck;
-	char fbuf[16]; /* enlarge when support for keywords is added */
 	char buf[64];
 
 	svars = nfcalloc( sizeof(*svars) );
@@ -472,6 +1146,7 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 	svars->chan = chan;
 	svars->uidval[0] = svars->uidval[1] = -1;
 	svars->srecadd = &svars->srecs;
+	svars->copyqadd = &svars->copyq;
 
 	for (t = 0; t < 2; t++) {
 		ctx[t]->name =
@@ -510,7 +1185,7 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 		return;
 	}
 	*s = 0;
-	if (mkdir( svars->dname, 0700 ) && errno != EEXIST) {
+	if (!(DFlags & DRYRUN) && mkdir( svars->dname, 0700 ) && errno != EEXIST) {
 		error( "Error: cannot create SyncState directory '%s': %s\n", svars->dname, strerror(errno) );
 		free( svars->dname );
 		free( svars );
@@ -521,6 +1196,7 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 	nfasprintf( &svars->jname, "%s.journal", svars->dname );
 	nfasprintf( &svars->nname, "%s.new", svars->dname );
 	nfasprintf( &svars->lname, "%s.lock", svars->dname );
+	nfasprintf( &svars->logname, "%s.log", svars->dname );
 	memset( &lck, 0, sizeof(lck) );
 #if SEEK_SET != 0
 	lck.l_whence = SEEK_SET;
@@ -528,74 +1204,78 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 #if F_WRLCK != 0
 	lck.l_type = F_WRLCK;
 #endif
-	if ((svars->lfd = open( svars->lname, O_WRONLY|O_CREAT, 0666 )) < 0) {
+	/* Nothing is written in --plan mode, so there is nothing to lock. */
+	if (DFlags & DRYRUN)
+		svars->lfd = -1;
+	else if ((svars->lfd = open( svars->lname, O_WRONLY|O_CREAT, 0666 )) < 0) {
 		error( "Error: cannot create lock file %s: %s\n", svars->lname, strerror(errno) );
 		svars->ret = SYNC_FAIL;
 		sync_bail2( svars );
 		return;
-	}
-	if (fcntl( svars->lfd, F_SETLK, &lck )) {
+	} else if (fcntl( svars->lfd, F_SETLK, &lck )) {
 		error( "Error: channel :%s:%s-:%s:%s is locked\n",
 		         chan->stores[M]->name, ctx[M]->name, chan->stores[S]->name, ctx[S]->name );
 		svars->ret = SYNC_FAIL;
 		sync_bail1( svars );
 		return;
 	}
-	if ((jfp = fopen( svars->dname, "r" ))) {
+	if ((fd = open( svars->dname, O_RDONLY )) >= 0) {
 		debug( "reading sync state %s ...\n", svars->dname );
-		if (!fgets( buf, sizeof(buf), jfp ) || !(t = strlen( buf )) || buf[t - 1] != '\n') {
-			error( "Error: incomplete sync state header in %s\n", svars->dname );
+		if (fstat( fd, &st )) {
+			error( "Error: cannot read sync state %s\n", svars->dname );
+			close( fd );
+			t = 0;
+		} else if ((svars->bino = st.st_ino), (svars->bsize = st.st_size),
+		           read( fd, buf, 8 ) == 8 && !memcmp( buf, BSTATE_MAGIC, 8 )) {
+			t = load_state_binary( svars, fd, st.st_size );
+			close( fd );
+		} else if (lseek( fd, 0, SEEK_SET ) || !(jfp = fdopen( fd, "r" ))) {
+			error( "Error: cannot read sync state %s\n", svars->dname );
+			close( fd );
+			t = 0;
+		} else {
+			t = load_state_text( svars, jfp );
 			fclose( jfp );
+		}
+		if (!t) {
 			svars->ret = SYNC_FAIL;
 			sync_bail( svars );
 			return;
 		}
-		if (sscanf( buf, "%d:%d %d:%d:%d", &svars->uidval[M], &svars->maxuid[M], &svars->uidval[S], &svars->smaxxuid, &svars->maxuid[S]) != 5) {
-			error( "Error: invalid sync state header in %s\n", svars->dname );
+	} else {
+		if (errno != ENOENT) {
+			error( "Error: cannot read sync state %s\n", svars->dname );
+			svars->ret = SYNC_FAIL;
+			sync_bail( svars );
+			return;
+		}
+	}
+	if ((jfp = fopen( svars->logname, "r" ))) {
+		if (!fgets( buf, sizeof(buf), jfp ) || !(t = strlen( buf )) || buf[t - 1] != '\n' ||
+		    sscanf( buf, JOURNAL_VERSION " %lu", &ino ) != 1)
+		{
+			error( "Error: invalid sync state log header in %s\n", svars->logname );
 			fclose( jfp );
 			svars->ret = SYNC_FAIL;
 			sync_bail( svars );
 			return;
 		}
-		line = 1;
-		while (fgets( buf, sizeof(buf), jfp )) {
-			line++;
-			if (!(t = strlen( buf )) || buf[t - 1] != '\n') {
-				error( "Error: incomplete sync state entry at %s:%d\n", svars->dname, line );
-				fclose( jfp );
-				svars->ret = SYNC_FAIL;
-				sync_bail( svars );
-				return;
-			}
-			fbuf[0] = 0;
-			if (sscanf( buf, "%d %d %15s", &t1, &t2, fbuf ) < 2) {
-				error( "Error: invalid sync state entry at %s:%d\n", svars->dname, line );
+		if (ino != (unsigned long)svars->bino)
+			debug( "ignoring stale sync state log\n" );
+		else {
+			debug( "reading sync state log ...\n" );
+			if (!load_journal( svars, jfp, svars->logname )) {
 				fclose( jfp );
 				svars->ret = SYNC_FAIL;
 				sync_bail( svars );
 				return;
 			}
-			srec = nfmalloc( sizeof(*srec) );
-			srec->uid[M] = t1;
-			srec->uid[S] = t2;
-			s = fbuf;
-			if (*s == 'X') {
-				s++;
-				srec->status = S_EXPIRE | S_EXPIRED;
-			} else
-				srec->status = 0;
-			srec->flags = parse_flags( s );
-			debug( "  entry (%d,%d,%u,%s)\n", srec->uid[M], srec->uid[S], srec->flags, srec->status & S_EXPIRED ? "X" : "" );
-			srec->msg[M] = srec->msg[S] = 0;
-			srec->tuid[0] = 0;
-			srec->next = 0;
-			*svars->srecadd = srec;
-			svars->srecadd = &srec->next;
+			svars->logged = 1;
 		}
 		fclose( jfp );
 	} else {
 		if (errno != ENOENT) {
-			error( "Error: cannot read sync state %s\n", svars->dname );
+			error( "Error: cannot read sync state log %s\n", svars->logname );
 			svars->ret = SYNC_FAIL;
 			sync_bail( svars );
 			return;
@@ -620,126 +1300,13 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 				sync_bail( svars );
 				return;
 			}
-			srec = 0;
-			line = 1;
-			while (fgets( buf, sizeof(buf), jfp )) {
-				line++;
-				if (!(t = strlen( buf )) || buf[t - 1] != '\n') {
-					error( "Error: incomplete journal entry at %s:%d\n", svars->jname, line );
-					fclose( jfp );
-					svars->ret = SYNC_FAIL;
-					sync_bail( svars );
-					return;
-				}
-				if (buf[0] == '#' ?
-				      (t3 = 0, (sscanf( buf + 2, "%d %d %n", &t1, &t2, &t3 ) < 2) || !t3 || (t - t3 != TUIDL + 3)) :
-				      buf[0] == '(' || buf[0] == ')' ?
-				        (sscanf( buf + 2, "%d", &t1 ) != 1) :
-				        buf[0] == '+' || buf[0] == '&' || buf[0] == '-' || buf[0] == '|' || buf[0] == '/' || buf[0] == '\\' ?
-				          (sscanf( buf + 2, "%d %d", &t1, &t2 ) != 2) :
-				          (sscanf( buf + 2, "%d %d %d", &t1, &t2, &t3 ) != 3))
-				{
-					error( "Error: malformed journal entry at %s:%d\n", svars->jname, line );
-					fclose( jfp );
-					svars->ret = SYNC_FAIL;
-					sync_bail( svars );
-					return;
-				}
-				if (buf[0] == '(')
-					svars->maxuid[M] = t1;
-				else if (buf[0] == ')')
-					svars->maxuid[S] = t1;
-				else if (buf[0] == '|') {
-					svars->uidval[M] = t1;
-					svars->uidval[S] = t2;
-				} else if (buf[0] == '+') {
-					srec = nfmalloc( sizeof(*srec) );
-					srec->uid[M] = t1;
-					srec->uid[S] = t2;
-					debug( "  new entry(%d,%d)\n", t1, t2 );
-					srec->msg[M] = srec->msg[S] = 0;
-					srec->status = 0;
-					srec->flags = 0;
-					srec->tuid[0] = 0;
-					srec->next = 0;
-					*svars->srecadd = srec;
-					svars->srecadd = &srec->next;
-				} else {
-					for (nsrec = srec; srec; srec = srec->next)
-						if (srec->uid[M] == t1 && srec->uid[S] == t2)
-							goto syncfnd;
-					for (srec = svars->srecs; srec != nsrec; srec = srec->next)
-						if (srec->uid[M] == t1 && srec->uid[S] == t2)
-							goto syncfnd;
-					error( "Error: journal entry at %s:%d refers to non-existing sync state entry\n", svars->jname, line );
-					fclose( jfp );
-					svars->ret = SYNC_FAIL;
-					sync_bail( svars );
-					return;
-				  syncfnd:
-					debugn( "  entry(%d,%d,%u) ", srec->uid[M], srec->uid[S], srec->flags );
-					switch (buf[0]) {
-					case '-':
-						debug( "killed\n" );
-						srec->status = S_DEAD;
-						break;
-					case '#':
-						debug( "TUID now %." stringify(TUIDL) "s\n", buf + t3 + 2 );
-						memcpy( srec->tuid, buf + t3 + 2, TUIDL );
-						break;
-					case '&':
-						debug( "TUID %." stringify(TUIDL) "s lost\n", srec->tuid );
-						srec->flags = 0;
-						srec->tuid[0] = 0;
-						break;
-					case '<':
-						debug( "master now %d\n", t3 );
-						srec->uid[M] = t3;
-						srec->tuid[0] = 0;
-						break;
-					case '>':
-						debug( "slave now %d\n", t3 );
-						srec->uid[S] = t3;
-						srec->tuid[0] = 0;
-						break;
-					case '*':
-						debug( "flags now %d\n", t3 );
-						srec->flags = t3;
-						break;
-					case '~':
-						debug( "expire now %d\n", t3 );
-						if (t3)
-							srec->status |= S_EXPIRE;
-						else
-							srec->status &= ~S_EXPIRE;
-						break;
-					case '\\':
-						t3 = (srec->status & S_EXPIRED);
-						debug( "expire back to %d\n", t3 / S_EXPIRED );
-						if (t3)
-							srec->status |= S_EXPIRE;
-						else
-							srec->status &= ~S_EXPIRE;
-						break;
-					case '/':
-						t3 = (srec->status & S_EXPIRE);
-						debug( "expired now %d\n", t3 / S_EXPIRE );
-						if (t3) {
-							if (svars->smaxxuid < srec->uid[S])
-								svars->smaxxuid = srec->uid[S];
-							srec->status |= S_EXPIRED;
-						} else
-							srec->status &= ~S_EXPIRED;
-						break;
-					default:
-						error( "Error: unrecognized journal entry at %s:%d\n", svars->jname, line );
-						fclose( jfp );
-						svars->ret = SYNC_FAIL;
-						sync_bail( svars );
-						return;
-					}
-				}
+			if (!load_journal( svars, jfp, svars->jname )) {
+				fclose( jfp );
+				svars->ret = SYNC_FAIL;
+				sync_bail( svars );
+				return;
 			}
+			line = 1;
 		}
 		fclose( jfp );
 	} else {
@@ -750,22 +1317,46 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 			return;
 		}
 	}
-	if (!(svars->nfp = fopen( svars->nname, "w" ))) {
-		error( "Error: cannot write new sync state %s\n", svars->nname );
-		svars->ret = SYNC_FAIL;
-		sync_bail( svars );
-		return;
-	}
-	if (!(svars->jfp = fopen( svars->jname, "a" ))) {
-		error( "Error: cannot write journal %s\n", svars->jname );
-		fclose( svars->nfp );
-		svars->ret = SYNC_FAIL;
-		sync_bail( svars );
-		return;
+	compact_srecs( svars );
+	svars->fresh = svars->uidval[M] < 0 && !svars->srecs;
+	/* A recovered journal must be replayed after the log, so it is
+	   continued instead. */
+	if (DFlags & DRYRUN) {
+		/* Nothing must be recorded, but the journal is written to
+		   until the plan is made. */
+		if (!(svars->jfp = tmpfile())) {
+			perror( "cannot create temporary file" );
+			svars->ret = SYNC_FAIL;
+			sync_bail( svars );
+			return;
+		}
+	} else if (global_state_log && !line) {
+		svars->logmode = 1;
+		if (!(svars->jfp = fopen( svars->logname, svars->logged ? "a" : "w" ))) {
+			error( "Error: cannot write sync state log %s\n", svars->logname );
+			svars->ret = SYNC_FAIL;
+			sync_bail( svars );
+			return;
+		}
+		if (!svars->logged)
+			Fprintf( svars->jfp, JOURNAL_VERSION " %lu\n", (unsigned long)svars->bino );
+	} else {
+		if (!(svars->nfp = fopen( svars->nname, "w" ))) {
+			error( "Error: cannot write new sync state %s\n", svars->nname );
+			svars->ret = SYNC_FAIL;
+			sync_bail( svars );
+			return;
+		}
+		if (!(svars->jfp = fopen( svars->jname, "a" ))) {
+			error( "Error: cannot write journal %s\n", svars->jname );
+			fclose( svars->nfp );
+			svars->ret = SYNC_FAIL;
+			sync_bail( svars );
+			return;
+		}
+		if (!line)
+			Fprintf( svars->jfp, JOURNAL_VERSION "\n" );
 	}
-	setlinebuf( svars->jfp );
-	if (!line)
-		Fprintf( svars->jfp, JOURNAL_VERSION "\n" );
 
 	opts[M] = opts[S] = 0;
 	for (t = 0; t < 2; t++) {
@@ -798,25 +1389,57 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 		if (chan->ops[t] & OP_CREATE)
 			opts[t] |= OPEN_CREATE;
 	}
+	if (DFlags & DRYRUN)
+		for (t = 0; t < 2; t++) {
+			opts[t] &= ~OPEN_CREATE;
+			opts[t] |= OPEN_READONLY;
+			if (chan->ops[t] & (OP_NEW|OP_RENEW))
+				opts[1-t] |= OPEN_SIZE;
+			if (chan->ops[t] & OP_EXPUNGE)
+				opts[t] |= OPEN_FLAGS;
+		}
 	if ((chan->ops[S] & (OP_NEW|OP_RENEW)) && chan->max_messages)
 		opts[S] |= OPEN_OLD|OPEN_NEW|OPEN_FLAGS;
-	if (line)
-		for (srec = svars->srecs; srec; srec = srec->next) {
-			if (srec->status & S_DEAD)
-				continue;
-			if ((mvBit(srec->status, S_EXPIRE, S_EXPIRED) ^ srec->status) & S_EXPIRED)
-				opts[S] |= OPEN_OLD|OPEN_FLAGS;
-			if (srec->tuid[0]) {
-				if (srec->uid[M] == -2)
-					opts[M] |= OPEN_OLD|OPEN_FIND;
-				else if (srec->uid[S] == -2)
-					opts[S] |= OPEN_OLD|OPEN_FIND;
+	/* Messages which were expunged from previously synced boxes may
+	   turn up as new ones in this one. */
+	if (chan->detect_moves)
+		for (t = 0; t < 2; t++)
+			if ((chan->ops[t] & OP_NEW) && ctx[t]->stashed)
+				opts[1-t] |= OPEN_MSGID|OPEN_SIZE;
+	for (srec = svars->srecs; srec; srec = srec->next) {
+		if (srec->status & S_DEAD)
+			continue;
+		if ((mvBit(srec->status, S_EXPIRE, S_EXPIRED) ^ srec->status) & S_EXPIRED)
+			opts[S] |= OPEN_OLD|OPEN_FLAGS;
+		for (t = 0; t < 2; t++)
+			if (srec->uid[t] == -2) {
+				if (srec->tuid)
+					opts[t] |= OPEN_OLD|OPEN_FIND;
+				/* The copy may have to be told by its Message-ID,
+				   which is loaded later; see load_lost_msgids(). */
+				opts[t] |= OPEN_NEW|OPEN_SIZE|lines_opt( svars, t );
+				opts[1-t] |= OPEN_OLD|OPEN_SIZE|lines_opt( svars, 1-t );
+				svars->lost = 1;
 			}
-		}
+	}
 	svars->drv[M]->prepare_opts( ctx[M], opts[M] );
 	svars->drv[S]->prepare_opts( ctx[S], opts[S] );
 
 	svars->find = line != 0;
+	/* Passes must not overlap in the messages they look at, and some
+	   decisions need to see the whole mailbox. */
+	if (chan->sync_window && !svars->find && !svars->lost && !svars->smaxxuid && !chan->max_messages &&
+	    !(DFlags & DRYRUN) && !trash_expunged( svars, M ) && !trash_expunged( svars, S ))
+	{
+		svars->window = chan->sync_window;
+		for (t = 0; t < 2; t++) {
+			if (!(ctx[t]->opts & (OPEN_OLD|OPEN_NEW)))
+				svars->wdone |= 1 << t;
+			svars->whi[t] = (ctx[t]->opts & OPEN_OLD) ? 0 : svars->maxuid[t];
+		}
+		run_windows( svars );
+		return;
+	}
 	if (!svars->smaxxuid && select_box( svars, M, (ctx[M]->opts & OPEN_OLD) ? 1 : INT_MAX, 0, 0 ))
 		return;
 	select_box( svars, S, (ctx[S]->opts & OPEN_OLD) ? 1 : INT_MAX, 0, 0 );
@@ -830,7 +1453,9 @@ select_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nmexcs )
 	sync_rec_t *srec;
 	int maxwuid;
 
-	if (svars->ctx[t]->opts & OPEN_NEW) {
+	if (svars->window) {
+		maxwuid = svars->whi[t];
+	} else if (svars->ctx[t]->opts & OPEN_NEW) {
 		if (minwuid > svars->maxuid[t] + 1)
 			minwuid = svars->maxuid[t] + 1;
 		maxwuid = INT_MAX;
@@ -841,11 +1466,112 @@ select_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nmexcs )
 				maxwuid = srec->uid[t];
 	} else
 		maxwuid = 0;
+	svars->sbegin[t] = get_time();
 	info( "Selecting %s %s...\n", str_ms[t], svars->ctx[t]->name );
 	debug( maxwuid == INT_MAX ? "selecting %s [%d,inf]\n" : "selecting %s [%d,%d]\n", str_ms[t], minwuid, maxwuid );
 	return svars->drv[t]->select( svars->ctx[t], minwuid, maxwuid, mexcs, nmexcs, box_selected, AUX );
 }
 
+/* Whether messages expunged from the box may need to be trashed first.
+   Expunging an IMAP box would take out messages of later passes unseen. */
+static int
+trash_expunged( sync_vars_t *svars, int t )
+{
+	return (svars->chan->ops[t] & OP_EXPUNGE) &&
+	       (svars->chan->stores[t]->trash ||
+	        (svars->chan->stores[1-t]->trash && svars->chan->stores[1-t]->trash_remote_new));
+}
+
+#define in_window(svars, t, uid) ((uid) >= (svars)->wlo[t] && (uid) <= (svars)->whi[t])
+
+/* Start the next pass of a windowed sync. Each side advances through its
+   UID space by the window size; the last window of a side is open-ended,
+   so messages arriving meanwhile are not missed. A sync record belongs to
+   the pass covering its master UID, or its slave UID if the master side
+   is not listed in full. The slave messages of the records are listed
+   regardless of the slave window. */
+static int
+select_window( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	int t, lo, hi, own, *excs, nexcs, aexcs;
+
+	for (t = 0; t < 2; t++) {
+		if (svars->wpass) {
+			svars->drv[t]->prepare_paths( svars->ctx[t] );
+			svars->state[t] = 0;
+		}
+		if (svars->wdone & (1 << t)) {
+			svars->wlo[t] = INT_MAX;
+			svars->whi[t] = 0;
+			continue;
+		}
+		lo = svars->whi[t] + 1;
+		hi = lo > INT_MAX - svars->window ? INT_MAX : lo + svars->window - 1;
+		/* Without a known UIDNEXT, there is no telling where the box ends. */
+		if (svars->wpass && (!svars->ctx[t]->uidnext || hi >= svars->ctx[t]->uidnext - 1))
+			hi = INT_MAX;
+		if (hi == INT_MAX)
+			svars->wdone |= 1 << t;
+		svars->wlo[t] = lo;
+		svars->whi[t] = hi;
+	}
+	if (svars->wpass)
+		compact_srecs( svars );
+	debug( "pass %d: master [%d,%d], slave [%d,%d]\n", svars->wpass + 1,
+	       svars->wlo[M], svars->whi[M], svars->wlo[S], svars->whi[S] );
+	svars->wpass++;
+
+	excs = 0;
+	nexcs = aexcs = 0;
+	for (srec = svars->srecs; srec; srec = srec->next) {
+		srec->status &= ~(S_DONE|S_INWIN);
+		srec->msg[M] = srec->msg[S] = 0;
+		if ((svars->ctx[M]->opts & OPEN_OLD) && srec->uid[M] > 0)
+			own = in_window( svars, M, srec->uid[M] );
+		else if ((svars->ctx[S]->opts & OPEN_OLD) && srec->uid[S] > 0)
+			own = in_window( svars, S, srec->uid[S] );
+		else
+			own = svars->wpass == 1;
+		if (!own)
+			continue;
+		srec->status |= S_INWIN;
+		if ((svars->ctx[S]->opts & OPEN_OLD) && srec->uid[S] > 0 && !in_window( svars, S, srec->uid[S] )) {
+			if (nexcs == aexcs) {
+				aexcs = aexcs * 2 + 100;
+				excs = nfrealloc( excs, aexcs * sizeof(int) );
+			}
+			excs[nexcs++] = srec->uid[S];
+		}
+	}
+	if (select_box( svars, M, svars->wlo[M], 0, 0 )) {
+		free( excs );
+		return 1;
+	}
+	return select_box( svars, S, svars->wlo[S], excs, nexcs );
+}
+
+/* The passes are started from a loop rather than from the end of the
+   previous one, so synchronous drivers do not nest them ever deeper. */
+static void
+run_windows( sync_vars_t *svars )
+{
+	int next;
+
+	if (svars->wnext) {
+		*svars->wnext = 1;
+		return;
+	}
+	do {
+		next = 0;
+		svars->wnext = &next;
+		select_window( svars );
+		if (next < 0)
+			return; /* svars is gone */
+	} while (next);
+	svars->wnext = 0;
+}
+
 typedef struct {
 	void *aux;
 	sync_rec_t *srec;
@@ -854,6 +1580,289 @@ typedef struct {
 static int msg_found_sel( int sts, int uid, void *aux );
 static int msgs_found_sel( sync_vars_t *svars, int t );
 
+/* Start over with the selection of both boxes, this time loading all
+   messages together with what is needed to re-pair them. */
+static void
+reselect_boxes( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	int t;
+
+	for (t = 0; t < 2; t++) {
+		svars->state[t] = 0;
+		svars->find_old_total[t] = svars->find_old_done[t] = 0;
+		svars->drv[t]->prepare_paths( svars->ctx[t] );
+		svars->drv[t]->prepare_opts( svars->ctx[t], svars->ctx[t]->opts | lines_opt( svars, t ) |
+		                             OPEN_OLD|OPEN_NEW|OPEN_FLAGS|OPEN_SIZE|OPEN_MSGID );
+	}
+	for (srec = svars->srecs; srec; srec = srec->next)
+		srec->msg[M] = srec->msg[S] = 0;
+	svars->window = 0;
+	if (svars->recover & (1 << S))
+		svars->smaxxuid = 0;
+	if (select_box( svars, M, 1, 0, 0 ))
+		return;
+	select_box( svars, S, 1, 0, 0 );
+}
+
+/* Tell whether two messages may be the same, given their sizes and
+   whether their stores use CRLF line endings. The LF side is measured
+   as if it had CRLFs, which needs its line count. */
+static int
+sizes_match( message_t *m1, int cr1, message_t *m2, int cr2 )
+{
+	int sz1 = m1->size, sz2 = m2->size;
+	int tl = 9 + TUIDL; /* either may have an X-TUID header */
+
+	if (cr1 != cr2) {
+		if (cr1)
+			sz2 += m2->lines;
+		else
+			sz1 += m1->lines;
+		cr1 = 1;
+	}
+	return sz1 == sz2 || sz1 == sz2 + tl + cr1 || sz2 == sz1 + tl + cr1;
+}
+
+/* Hash a Message-ID for the lookup tables of recover_pairs() (FNV-1a). */
+static unsigned
+msgid_hash( const char *msgid )
+{
+	unsigned h = 2166136261U;
+
+	while (*msgid)
+		h = (h ^ (unsigned char)*msgid++) * 16777619U;
+	return h;
+}
+
+/* After a UIDVALIDITY change, the UIDs recorded for that side are worthless.
+   Pair up the messages again by matching Message-IDs and sizes; whatever
+   does not match is treated as new. */
+static void
+recover_pairs( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	message_t *tmsg, *omsg, **ents;
+	int t, tcr, ocr, nents, hsize, i, h, maxuid, *heads, *chain;
+
+	t = (svars->recover & (1 << M)) ? M : S;
+	tcr = (svars->drv[t]->flags / DRV_CRLF) & 1;
+	ocr = (svars->drv[1-t]->flags / DRV_CRLF) & 1;
+	debug( "re-pairing messages after UIDVALIDITY change of %s\n",
+	       svars->recover == 3 ? "both sides" : str_ms[t] );
+	if (svars->recover == 3) {
+		/* Nothing can be salvaged from the old state. */
+		for (srec = svars->srecs; srec; srec = srec->next) {
+			if (srec->status & S_DEAD)
+				continue;
+			srec->status = S_DEAD;
+			Fprintf( svars->jfp, "- %d %d\n", srec->uid[M], srec->uid[S] );
+		}
+	}
+
+	/* Index the messages of side t by Message-ID. */
+	for (nents = 0, tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next)
+		nents++;
+	ents = nfmalloc( (nents + 1) * sizeof(*ents) );
+	hsize = nents * 2 + 1;
+	heads = nfmalloc( hsize * sizeof(int) );
+	chain = nfmalloc( (nents + 1) * sizeof(int) );
+	for (h = 0; h < hsize; h++)
+		heads[h] = -1;
+	maxuid = 0;
+	for (nents = 0, tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next) {
+		if (maxuid < tmsg->uid)
+			maxuid = tmsg->uid;
+		if ((tmsg->status & M_DEAD) || !tmsg->msgid)
+			continue;
+		h = msgid_hash( tmsg->msgid ) % hsize;
+		ents[nents] = tmsg;
+		chain[nents] = heads[h];
+		heads[h] = nents++;
+	}
+
+	if (svars->recover == 3) {
+		for (omsg = svars->ctx[1-t]->msgs; omsg; omsg = omsg->next) {
+			if ((omsg->status & M_DEAD) || !omsg->msgid)
+				continue;
+			h = msgid_hash( omsg->msgid ) % hsize;
+			for (i = heads[h]; i >= 0; i = chain[i]) {
+				tmsg = ents[i];
+				if (!tmsg->srec && !strcmp( tmsg->msgid, omsg->msgid ) &&
+				    sizes_match( tmsg, tcr, omsg, ocr ))
+					goto pairnew;
+			}
+			continue;
+		  pairnew:
+			srec = new_srec( svars );
+			srec->uid[t] = tmsg->uid;
+			srec->uid[1-t] = omsg->uid;
+			srec->msg[t] = tmsg;
+			srec->msg[1-t] = omsg;
+			/* Whatever is set on only one side looks like a change there. */
+			srec->flags = tmsg->flags & omsg->flags;
+			tmsg->srec = omsg->srec = srec;
+			Fprintf( svars->jfp, "+ %d %d\n", srec->uid[M], srec->uid[S] );
+			Fprintf( svars->jfp, "* %d %d %u\n", srec->uid[M], srec->uid[S], srec->flags );
+			debug( "  pair(%d,%d) created\n", srec->uid[M], srec->uid[S] );
+		}
+	} else {
+		for (srec = svars->srecs; srec; srec = srec->next) {
+			if (srec->status & S_DEAD)
+				continue;
+			if ((omsg = srec->msg[1-t]) && omsg->msgid) {
+				h = msgid_hash( omsg->msgid ) % hsize;
+				for (i = heads[h]; i >= 0; i = chain[i]) {
+					tmsg = ents[i];
+					if (!tmsg->srec && !strcmp( tmsg->msgid, omsg->msgid ) &&
+					    sizes_match( tmsg, tcr, omsg, ocr ))
+						goto repair;
+				}
+			}
+			if (srec->uid[1-t] > 0) {
+				/* Without a counterpart, it must not look like a deletion. */
+				if (srec->uid[t]) {
+					debug( "  pair(%d,%d): no more %s\n", srec->uid[M], srec->uid[S], str_ms[t] );
+					Fprintf( svars->jfp, "%c %d %d 0\n", "<>"[t], srec->uid[M], srec->uid[S] );
+					srec->uid[t] = 0;
+				}
+			} else {
+				debug( "  pair(%d,%d): killed\n", srec->uid[M], srec->uid[S] );
+				srec->status = S_DEAD;
+				Fprintf( svars->jfp, "- %d %d\n", srec->uid[M], srec->uid[S] );
+			}
+			continue;
+		  repair:
+			debug( "  pair(%d,%d): %s now %d\n", srec->uid[M], srec->uid[S], str_ms[t], tmsg->uid );
+			Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], tmsg->uid );
+			srec->uid[t] = tmsg->uid;
+			srec->tuid = 0;
+			srec->msg[t] = tmsg;
+			tmsg->srec = srec;
+		}
+	}
+	free( chain );
+	free( heads );
+	free( ents );
+
+	for (t = 0; t < 2; t++)
+		if (svars->recover & (1 << t)) {
+			svars->uidval[t] = svars->ctx[t]->uidvalidity;
+			for (maxuid = 0, tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next)
+				if (tmsg->srec && maxuid < tmsg->uid)
+					maxuid = tmsg->uid;
+			svars->maxuid[t] = maxuid;
+			Fprintf( svars->jfp, "%c %d\n", "()"[t], maxuid );
+		}
+	Fprintf( svars->jfp, "| %d %d\n", svars->uidval[M], svars->uidval[S] );
+}
+
+/* Copies to targets which report UIDs carry no X-TUID header, so if the
+   UID did not make it to the journal, the TUID lookup comes up empty.
+   Such a copy is still among the target's unpaired messages above the
+   synced maximum, where it is recognized by Message-ID and size. */
+static void
+match_lost_copies( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	message_t *smsg, *tmsg;
+	int t;
+
+	debug( "looking for copies of unknown UID\n" );
+	for (srec = svars->srecs; srec; srec = srec->next) {
+		if (srec->status & S_DEAD)
+			continue;
+		if (srec->uid[M] == -2)
+			t = M;
+		else if (srec->uid[S] == -2)
+			t = S;
+		else
+			continue;
+		if (svars->recover & (1 << t))
+			continue; /* recover_pairs() took care of it */
+		if ((smsg = srec->msg[1-t]) && smsg->msgid) {
+			for (tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next)
+				if (!tmsg->srec && !(tmsg->status & M_DEAD) && tmsg->uid > svars->maxuid[t] &&
+				    tmsg->msgid && !strcmp( tmsg->msgid, smsg->msgid ) &&
+				    sizes_match( tmsg, (svars->drv[t]->flags / DRV_CRLF) & 1,
+				                 smsg, (svars->drv[1-t]->flags / DRV_CRLF) & 1 ))
+					goto found;
+		}
+		if (srec->tuid) {
+			debug( "  pair(%d,%d): TUID lost\n", srec->uid[M], srec->uid[S] );
+			Fprintf( svars->jfp, "& %d %d\n", srec->uid[M], srec->uid[S] );
+			srec->flags = 0;
+			srec->tuid = 0;
+		}
+		continue;
+	  found:
+		debug( "  pair(%d,%d): found %s copy by Message-ID, UID %d\n",
+		       srec->uid[M], srec->uid[S], str_ms[t], tmsg->uid );
+		Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], tmsg->uid );
+		srec->uid[t] = tmsg->uid;
+		srec->tuid = 0;
+		srec->msg[t] = tmsg;
+		tmsg->srec = srec;
+	}
+}
+
+static int msgs_matched( sync_vars_t *svars );
+
+static int
+msgids_loaded( int sts, void *aux )
+{
+	SVARS(aux)
+	double start;
+
+	if (check_ret( sts, svars, t ))
+		return 1;
+	svars->state[t] |= ST_LOADED_MSGIDS;
+	if (!(svars->state[1-t] & ST_LOADED_MSGIDS))
+		return 0;
+	start = get_time();
+	match_lost_copies( svars );
+	svars->ptime[PH_MATCH] += get_time() - start;
+	return msgs_matched( svars );
+}
+
+/* Only the unpaired messages above the synced maximum can be lost
+   copies, so only their Message-IDs and those of the originals of
+   the copies in question are loaded; see match_lost_copies(). */
+static int
+load_lost_msgids( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	message_t *tmsg, **msgs;
+	int t, lost[2], nmsgs, amsgs, ret;
+
+	lost[M] = lost[S] = 0;
+	for (srec = svars->srecs; srec; srec = srec->next)
+		if (!(srec->status & S_DEAD))
+			for (t = 0; t < 2; t++)
+				if (srec->uid[t] == -2 && !(svars->recover & (1 << t)))
+					lost[t] = 1;
+	for (t = 0; t < 2; t++) {
+		msgs = 0;
+		nmsgs = amsgs = 0;
+		for (tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next) {
+			if (tmsg->status & M_DEAD)
+				continue;
+			if (tmsg->srec ? tmsg->srec->uid[1-t] != -2 || !lost[1-t] :
+			                 !lost[t] || tmsg->uid <= svars->maxuid[t])
+				continue;
+			if (nmsgs == amsgs)
+				msgs = nfrealloc( msgs, (amsgs = amsgs * 2 + 100) * sizeof(*msgs) );
+			msgs[nmsgs++] = tmsg;
+		}
+		debug( "loading %d Message-IDs from %s\n", nmsgs, str_ms[t] );
+		ret = svars->drv[t]->load_msgids( svars->ctx[t], msgs, nmsgs, msgids_loaded, AUX );
+		free( msgs );
+		if (ret)
+			return 1;
+	}
+	return 0;
+}
+
 static int
 box_selected( int sts, void *aux )
 {
@@ -863,16 +1872,33 @@ box_selected( int sts, void *aux )
 
 	if (check_ret( sts, svars, t ))
 		return 1;
+	svars->ptime[PH_SELECT] += get_time() - svars->sbegin[t] - svars->ctx[t]->list_time;
+	svars->ptime[PH_LIST] += svars->ctx[t]->list_time;
 	if (svars->uidval[t] >= 0 && svars->uidval[t] != svars->ctx[t]->uidvalidity) {
-		error( "Error: UIDVALIDITY of %s changed (got %d, expected %d)\n",
-		         str_ms[t], svars->ctx[t]->uidvalidity, svars->uidval[t] );
-		svars->ret |= SYNC_FAIL;
-		cancel_sync( svars );
-		return 1;
+		if (!svars->chan->recover_uidval) {
+			error( "Error: UIDVALIDITY of %s changed (got %d, expected %d)\n",
+			         str_ms[t], svars->ctx[t]->uidvalidity, svars->uidval[t] );
+			svars->ret |= SYNC_FAIL;
+			cancel_sync( svars );
+			return 1;
+		}
+		if (!(svars->recover & (1 << t))) {
+			warn( "Warning: UIDVALIDITY of %s changed (got %d, expected %d); re-pairing messages\n",
+			      str_ms[t], svars->ctx[t]->uidvalidity, svars->uidval[t] );
+			svars->recover |= 1 << t;
+		}
 	}
 	info( "%s: %d messages, %d recent\n", str_ms[t], svars->ctx[t]->count, svars->ctx[t]->recent );
+	/* The first window is laid out before UIDNEXT is known;
+	   the box may well end within it. */
+	if (svars->window && !(svars->wdone & (1 << t)) && svars->ctx[t]->uidnext &&
+	    svars->whi[t] >= svars->ctx[t]->uidnext - 1)
+	{
+		svars->whi[t] = INT_MAX;
+		svars->wdone |= 1 << t;
+	}
 
-	if (svars->find) {
+	if (svars->find && !(svars->recover & (1 << t))) {
 		/*
 		 * Alternatively, the TUIDs could be fetched into the messages and
 		 * looked up here. This would make the search faster (probably) and
@@ -884,7 +1910,7 @@ box_selected( int sts, void *aux )
 		for (srec = svars->srecs; srec; srec = srec->next) {
 			if (srec->status & S_DEAD)
 				continue;
-			if (srec->uid[t] == -2 && srec->tuid[0]) {
+			if (srec->uid[t] == -2 && srec->tuid) {
 				debug( "  pair(%d,%d): lookup %s, TUID %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], str_ms[t], srec->tuid );
 				svars->find_old_total[t]++;
 				stats( svars );
@@ -913,13 +1939,11 @@ msg_found_sel( int sts, int uid, void *aux )
 		debug( "  -> new UID %d\n", uid );
 		Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], vars->srec->uid[M], vars->srec->uid[S], uid );
 		vars->srec->uid[t] = uid;
-		vars->srec->tuid[0] = 0;
+		vars->srec->tuid = 0;
 		break;
 	default:
-		debug( "  -> TUID lost\n" );
-		Fprintf( svars->jfp, "& %d %d\n", vars->srec->uid[M], vars->srec->uid[S] );
-		vars->srec->flags = 0;
-		vars->srec->tuid[0] = 0;
+		/* The copy may lack the header; see match_lost_copies(). */
+		debug( "  -> TUID not found\n" );
 		break;
 	}
 	free( vars );
@@ -934,69 +1958,110 @@ typedef struct {
 	int aflags, dflags;
 } flag_vars_t;
 
+/* In --plan mode, the operations are counted instead of being sent to the
+   stores, and their callbacks are invoked as if they had succeeded. IMAP
+   round trips are estimated as one per command; pipelining makes them
+   fewer. */
+static void
+plan_rtts( sync_vars_t *svars, int t, int n )
+{
+	if (svars->drv[t] == &imap_driver)
+		svars->plan[t].rtts += n;
+}
+
+/* Apply the change to the listed message like the drivers do, so the
+   later decisions see it. */
+static void
+plan_flags( sync_vars_t *svars, int t, message_t *msg, int aflags, int dflags )
+{
+	if (msg) {
+		aflags &= ~msg->flags;
+		dflags &= msg->flags;
+		msg->flags = (msg->flags | aflags) & ~dflags;
+	}
+	plan_rtts( svars, t, !!aflags + !!dflags );
+}
+
+static void
+print_plan( sync_vars_t *svars )
+{
+	plan_t *pl;
+	int t;
+
+	printf( "%s: %s <-> %s\n", svars->chan->name, svars->ctx[M]->name, svars->ctx[S]->name );
+	for (t = 0; t < 2; t++) {
+		pl = &svars->plan[t];
+		printf( "  %s: %d new (%lu bytes), %d flag changes, %d deletions, %d to trash, %d to expunge, %d round trips\n",
+		        str_ms[t], pl->nnew, pl->bytes, pl->nflags, pl->ndel, pl->ntrash, pl->nexp, pl->rtts );
+	}
+}
+
 static int flags_set_del( int sts, void *aux );
 static int flags_set_sync( int sts, void *aux );
 static void flags_set_sync_p2( sync_vars_t *svars, sync_rec_t *srec, int t );
 static int msgs_flags_set( sync_vars_t *svars, int t );
 static int msg_copied( int sts, int uid, copy_vars_t *vars );
 static void msg_copied_p2( sync_vars_t *svars, sync_rec_t *srec, int t, message_t *tmsg, int uid );
+static int commit_pending( sync_vars_t *svars, int t );
 static int msgs_copied( sync_vars_t *svars, int t );
 
 static int
 msgs_found_sel( sync_vars_t *svars, int t )
 {
-	sync_rec_t *srec, *nsrec = 0;
-	message_t *tmsg;
-	copy_vars_t *cv;
-	flag_vars_t *fv;
-	const char *diag;
-	int uid, minwuid, *mexcs, nmexcs, rmexcs, no[2], del[2], todel, nmsgs, t1, t2;
-	int sflags, nflags, aflags, dflags, nex;
+	sync_rec_t *srec;
+	message_t *tmsg, **tmsgp;
+	double start;
+	int minwuid, *mexcs, nmexcs, rmexcs;
 	char fbuf[16]; /* enlarge when support for keywords is added */
 
 	if (!(svars->state[t] & ST_SENT_FIND_OLD) || svars->find_old_done[t] < svars->find_new_total[t])
 		return 0;
 
-	/*
-	 * Mapping tmsg -> srec (this variant) is dog slow for new messages.
-	 * Mapping srec -> tmsg is dog slow for deleted messages.
-	 * One solution would be using binary search on an index array.
-	 * msgs are already sorted by UID, srecs would have to be sorted by uid[t].
-	 */
 	debug( "matching messages against sync records\n" );
-	for (tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next) {
-		uid = tmsg->uid;
-		if (DFlags & DEBUG) {
-			make_flags( tmsg->flags, fbuf );
-			printf( svars->ctx[t]->opts & OPEN_SIZE ? "  message %5d, %-4s, %6d: " : "  message %5d, %-4s: ", uid, fbuf, tmsg->size );
+	start = get_time();
+	for (srec = svars->srecs; srec; srec = srec->next) {
+		if ((srec->status & S_DEAD) || srec->uid[t] <= 0 || (svars->recover & (1 << t)))
+			continue;
+		if ((tmsg = find_uid_msg( svars->ctx[t], srec->uid[t] )) && !tmsg->srec) {
+			tmsg->srec = srec;
+			srec->msg[t] = tmsg;
 		}
-		for (srec = nsrec; srec; srec = srec->next) {
-			if (srec->status & S_DEAD)
-				continue;
-			if (srec->uid[t] == uid) {
-				diag = srec == nsrec ? "adjacently" : "after gap";
-				goto found;
-			}
+	}
+	if (svars->window) {
+		/* Messages of records which belong to other passes are out of sight. */
+		for (tmsgp = &svars->ctx[t]->msgs; (tmsg = *tmsgp); ) {
+			if (tmsg->srec && !(tmsg->srec->status & S_INWIN)) {
+				tmsg->srec->msg[t] = 0;
+				*tmsgp = tmsg->next;
+			} else
+				tmsgp = &tmsg->next;
 		}
-		for (srec = svars->srecs; srec != nsrec; srec = srec->next) {
-			if (srec->status & S_DEAD)
-				continue;
-			if (srec->uid[t] == uid) {
-				diag = "after reset";
-				goto found;
-			}
+		svars->ctx[t]->msgapp = tmsgp;
+		free( svars->ctx[t]->msgidx );
+		svars->ctx[t]->msgidx = 0;
+	}
+	if (DFlags & DEBUG)
+		for (tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next) {
+			make_flags( tmsg->flags, fbuf );
+			printf( svars->ctx[t]->opts & OPEN_SIZE ? "  message %5d, %-4s, %6d: " : "  message %5d, %-4s: ", tmsg->uid, fbuf, tmsg->size );
+			if (tmsg->srec)
+				debug( "pairs %5d\n", tmsg->srec->uid[1-t] );
+			else
+				debug( "new\n" );
 		}
-		tmsg->srec = 0;
-		debug( "new\n" );
-		continue;
-	  found:
-		tmsg->srec = srec;
-		srec->msg[t] = tmsg;
-		nsrec = srec->next;
-		debug( "pairs %5d %s\n", srec->uid[1-t], diag );
+	svars->ptime[PH_MATCH] += get_time() - start;
+
+	if (svars->recover && !svars->recovering) {
+		/* The master is not selected yet if there were expired messages. */
+		if ((t == M || !svars->smaxxuid) &&
+		    (!(svars->state[1-t] & ST_SENT_FIND_OLD) || svars->find_old_done[1-t] < svars->find_new_total[1-t]))
+			return 0;
+		svars->recovering = 1;
+		reselect_boxes( svars );
+		return 1;
 	}
 
-	if ((t == S) && svars->smaxxuid) {
+	if ((t == S) && svars->smaxxuid && !svars->recover) {
 		debug( "preparing master selection - max expired slave uid is %d\n", svars->smaxxuid );
 		mexcs = 0;
 		nmexcs = rmexcs = 0;
@@ -1057,17 +2122,53 @@ msgs_found_sel( sync_vars_t *svars, int t )
 	if (!(svars->state[1-t] & ST_SENT_FIND_OLD) || svars->find_old_done[1-t] < svars->find_new_total[1-t])
 		return 0;
 
-	if (svars->uidval[M] < 0 || svars->uidval[S] < 0) {
+	if (svars->recover) {
+		start = get_time();
+		recover_pairs( svars );
+		svars->ptime[PH_MATCH] += get_time() - start;
+	} else if (svars->uidval[M] < 0 || svars->uidval[S] < 0) {
 		svars->uidval[M] = svars->ctx[M]->uidvalidity;
 		svars->uidval[S] = svars->ctx[S]->uidvalidity;
 		Fprintf( svars->jfp, "| %d %d\n", svars->uidval[M], svars->uidval[S] );
 	}
+	if (svars->lost)
+		return load_lost_msgids( svars );
+	return msgs_matched( svars );
+}
+
+static int
+msgs_matched( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	message_t *tmsg;
+	copy_vars_t *cv;
+	flag_vars_t *fv;
+	int no[2], del[2], todel, nmsgs, bulk, t, t1, t2;
+	int sflags, nflags, aflags, dflags, nex;
 
-	info( "Synchronizing...\n" );
+	if (!(DFlags & DRYRUN))
+		info( "Synchronizing...\n" );
+
+	/* When filling an empty slave from scratch, the copies are made
+	   verbatim and without flushing the journal for each of them. The
+	   records are still journalled before the first copy is stored, so
+	   after a crash match_lost_copies() finds the messages of the
+	   uncommitted batch by their Message-IDs. This requires a slave which
+	   reports the UIDs of all new messages, as there are no TUIDs. */
+	if (svars->fresh) {
+		svars->fresh = 0;
+		if ((svars->chan->ops[S] & OP_NEW) && !svars->ctx[S]->count && (svars->drv[S]->flags & DRV_UIDS)) {
+			debug( "bulk importing into empty slave\n" );
+			svars->bulk = 1;
+			svars->ctx[S]->opts |= OPEN_BULK;
+		}
+	}
 
 	debug( "synchronizing new entries\n" );
+	phase_begin( svars, PH_COPY );
 	svars->osrecadd = svars->srecadd;
 	for (t = 0; t < 2; t++) {
+		bulk = svars->bulk && t == S;
 		for (nmsgs = 0, tmsg = svars->ctx[1-t]->msgs; tmsg; tmsg = tmsg->next)
 			if (tmsg->srec ? tmsg->srec->uid[t] < 0 && (tmsg->srec->uid[t] == -1 ? (svars->chan->ops[t] & OP_RENEW) : (svars->chan->ops[t] & OP_NEW)) : (svars->chan->ops[t] & OP_NEW)) {
 				debug( "new message %d on %s\n", tmsg->uid, str_ms[1-t] );
@@ -1079,13 +2180,8 @@ msgs_found_sel( sync_vars_t *svars, int t )
 						srec->status |= S_DONE;
 						debug( "  -> pair(%d,%d) exists\n", srec->uid[M], srec->uid[S] );
 					} else {
-						srec = nfmalloc( sizeof(*srec) );
-						srec->next = 0;
-						*svars->srecadd = srec;
-						svars->srecadd = &srec->next;
+						srec = new_srec( svars );
 						srec->status = S_DONE;
-						srec->flags = 0;
-						srec->tuid[0] = 0;
 						srec->uid[1-t] = tmsg->uid;
 						srec->uid[t] = -2;
 						Fprintf( svars->jfp, "+ %d %d\n", srec->uid[M], srec->uid[S] );
@@ -1097,10 +2193,6 @@ msgs_found_sel( sync_vars_t *svars, int t )
 							Fprintf( svars->jfp, "* %d %d %u\n", srec->uid[M], srec->uid[S], srec->flags );
 							debug( "  -> updated flags to %u\n", tmsg->flags );
 						}
-						for (t1 = 0; t1 < TUIDL; t1++) {
-							t2 = arc4_getbyte() & 0x3f;
-							srec->tuid[t1] = t2 < 26 ? t2 + 'A' : t2 < 52 ? t2 + 'a' - 26 : t2 < 62 ? t2 + '0' - 52 : t2 == 62 ? '+' : '/';
-						}
 						svars->new_total[t]++;
 						stats( svars );
 						cv = nfmalloc( sizeof(*cv) );
@@ -1108,10 +2200,33 @@ msgs_found_sel( sync_vars_t *svars, int t )
 						cv->aux = AUX;
 						cv->srec = srec;
 						cv->msg = tmsg;
-						Fprintf( svars->jfp, "# %d %d %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], srec->tuid );
-						debug( "  -> %sing message, TUID %." stringify(TUIDL) "s\n", str_hl[t], srec->tuid );
-						if (copy_msg( cv ))
-							return 1;
+						if (bulk)
+							debug( "  -> %sing message\n", str_hl[t] );
+						else {
+							if (!srec->tuid)
+								srec->tuid = new_tuid( svars );
+							for (t1 = 0; t1 < TUIDL; t1++) {
+								t2 = arc4_getbyte() & 0x3f;
+								srec->tuid[t1] = t2 < 26 ? t2 + 'A' : t2 < 52 ? t2 + 'a' - 26 : t2 < 62 ? t2 + '0' - 52 : t2 == 62 ? '+' : '/';
+							}
+							Fprintf( svars->jfp, "# %d %d %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], srec->tuid );
+							debug( "  -> %sing message, TUID %." stringify(TUIDL) "s\n", str_hl[t], srec->tuid );
+						}
+						if (DFlags & DRYRUN) {
+							svars->plan[t].nnew++;
+							svars->plan[t].bytes += tmsg->size;
+							plan_rtts( svars, 1-t, 1 );
+							plan_rtts( svars, t, 1 );
+							if (msg_copied( SYNC_OK, 0, cv ))
+								return 1;
+						} else if (svars->chan->detect_moves && tmsg->msgid && svars->ctx[t]->stashed) {
+							jflush( svars );
+							if (svars->drv[t]->adopt_msg( svars->ctx[t], tmsg->msgid, tmsg->size,
+							                              (svars->drv[1-t]->flags / DRV_CRLF) & 1,
+							                              tmsg->flags, msg_adopted, cv ))
+								return 1;
+						} else
+							queue_copy( svars, cv );
 					} else {
 						if (tmsg->srec) {
 							debug( "  -> not %sing - still too big\n", str_hl[t] );
@@ -1122,14 +2237,17 @@ msgs_found_sel( sync_vars_t *svars, int t )
 					}
 				}
 			}
+		if (copy_queued( svars, t ))
+			return 1;
 		svars->state[t] |= ST_SENT_NEW;
 		if (msgs_copied( svars, t ))
 			return 1;
 	}
 
 	debug( "synchronizing old entries\n" );
+	phase_begin( svars, PH_FLAGS );
 	for (srec = svars->srecs; srec != *svars->osrecadd; srec = srec->next) {
-		if (srec->status & (S_DEAD|S_DONE))
+		if ((srec->status & (S_DEAD|S_DONE)) || (svars->window && !(srec->status & S_INWIN)))
 			continue;
 		debug( "pair (%d,%d)\n", srec->uid[M], srec->uid[S] );
 		no[M] = !srec->msg[M] && (svars->ctx[M]->opts & OPEN_OLD);
@@ -1162,7 +2280,19 @@ msgs_found_sel( sync_vars_t *svars, int t )
 						fv = nfmalloc( sizeof(*fv) );
 						fv->aux = AUX;
 						fv->srec = srec;
-						if (svars->drv[t]->set_flags( svars->ctx[t], srec->msg[t], srec->uid[t], F_DELETED, 0, flags_set_del, fv ))
+						jflush( svars );
+						if (DFlags & DRYRUN) {
+							svars->plan[t].ndel++;
+							plan_flags( svars, t, srec->msg[t], F_DELETED, 0 );
+							if (flags_set_del( DRV_OK, fv ))
+								return 1;
+						} else if (srec->msg[t] && svars->chan->detect_moves && !svars->ctx[t]->conf->trash &&
+						    (svars->chan->ops[t] & (OP_NEW|OP_EXPUNGE)) == (OP_NEW|OP_EXPUNGE)) {
+							/* It might have been moved to a box which is synced later. */
+							debug( "  -> stashing\n" );
+							if (svars->drv[t]->stash_msg( svars->ctx[t], srec->msg[t], flags_set_del, fv ))
+								return 1;
+						} else if (svars->drv[t]->set_flags( svars->ctx[t], srec->msg[t], srec->uid[t], F_DELETED, 0, flags_set_del, fv ))
 							return 1;
 					} else
 						debug( "  not %sing delete\n", str_hl[t] );
@@ -1243,7 +2373,7 @@ msgs_found_sel( sync_vars_t *svars, int t )
 
 	debug( "synchronizing flags\n" );
 	for (srec = svars->srecs; srec != *svars->osrecadd; srec = srec->next) {
-		if (srec->status & (S_DEAD|S_DONE))
+		if ((srec->status & (S_DEAD|S_DONE)) || (svars->window && !(srec->status & S_INWIN)))
 			continue;
 		for (t = 0; t < 2; t++) {
 			aflags = srec->aflags[t];
@@ -1273,14 +2403,22 @@ msgs_found_sel( sync_vars_t *svars, int t )
 				fv->srec = srec;
 				fv->aflags = aflags;
 				fv->dflags = dflags;
-				if (svars->drv[t]->set_flags( svars->ctx[t], srec->msg[t], srec->uid[t], aflags, dflags, flags_set_sync, fv ))
+				jflush( svars );
+				if (DFlags & DRYRUN) {
+					svars->plan[t].nflags++;
+					plan_flags( svars, t, srec->msg[t], aflags, dflags );
+					if (flags_set_sync( DRV_OK, fv ))
+						return 1;
+				} else if (svars->drv[t]->set_flags( svars->ctx[t], srec->msg[t], srec->uid[t], aflags, dflags, flags_set_sync, fv ))
 					return 1;
 			} else
 				flags_set_sync_p2( svars, srec, t );
 		}
 	}
+	jflush( svars );
 	for (t = 0; t < 2; t++) {
-		svars->drv[t]->commit( svars->ctx[t] );
+		if (check_ret( svars->drv[t]->commit( svars->ctx[t] ), svars, t ))
+			return 1;
 		svars->state[t] |= ST_SENT_FLAGS;
 		if (msgs_flags_set( svars, t ))
 			return 1;
@@ -1295,6 +2433,10 @@ msg_copied( int sts, int uid, copy_vars_t *vars )
 
 	switch (sts) {
 	case SYNC_OK:
+		/* A verbatim copy whose UID was not reported cannot be found by
+		   its TUID; the next run looks for it by Message-ID instead. */
+		if (uid == -2 && !vars->tagged)
+			vars->srec->tuid = 0;
 		msg_copied_p2( svars, vars->srec, t, vars->msg, uid );
 		break;
 	case SYNC_NOGOOD:
@@ -1311,23 +2453,66 @@ msg_copied( int sts, int uid, copy_vars_t *vars )
 	free( vars );
 	svars->new_done[t]++;
 	stats( svars );
+	if (svars->npend[t] == MAX_PEND_UIDS && commit_pending( svars, t ))
+		return 1;
 	return msgs_copied( svars, t );
 }
 
+/* The UIDs of freshly stored messages are journalled only after the
+ * target store committed them, so a crash cannot leave the journal
+ * pointing at messages which never made it to disk. Until then, the
+ * TUIDs recorded in the journal allow finding the messages again,
+ * with match_lost_copies() covering the verbatim copies. If the commit
+ * fails, nothing is journalled and the box is given up on. */
+static int
+commit_pending( sync_vars_t *svars, int t )
+{
+	sync_rec_t *srec;
+	int i;
+
+	if (!svars->npend[t])
+		return 0;
+	jflush( svars );
+	if (check_ret( svars->drv[t]->commit( svars->ctx[t] ), svars, t ))
+		return 1;
+	for (i = 0; i < svars->npend[t]; i++) {
+		srec = svars->pend[t][i].srec;
+		Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], svars->pend[t][i].uid );
+		srec->uid[t] = svars->pend[t][i].uid;
+		srec->tuid = 0;
+	}
+	svars->npend[t] = 0;
+	/* In bulk mode, the progress is recorded once per batch. */
+	if (svars->bulk && t == S) {
+		Fprintf( svars->jfp, "( %d\n", svars->maxuid[M] );
+		jflush( svars );
+	}
+	return 0;
+}
+
 static void
 msg_copied_p2( sync_vars_t *svars, sync_rec_t *srec, int t, message_t *tmsg, int uid )
 {
-	if (srec->uid[t] != uid) {
+	if (uid > 0 && srec->uid[t] != uid) {
+		debug( "  -> new UID %d\n", uid );
+		if (!svars->pend[t])
+			svars->pend[t] = nfmalloc( MAX_PEND_UIDS * sizeof(pend_uid_t) );
+		svars->pend[t][svars->npend[t]].srec = srec;
+		svars->pend[t][svars->npend[t]].uid = uid;
+		svars->npend[t]++;
+	} else if (srec->uid[t] != uid) {
 		debug( "  -> new UID %d\n", uid );
 		Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], uid );
 		srec->uid[t] = uid;
-		srec->tuid[0] = 0;
+		srec->tuid = 0;
 	}
 	if (!tmsg->srec) {
 		tmsg->srec = srec;
 		if (svars->maxuid[1-t] < tmsg->uid) {
 			svars->maxuid[1-t] = tmsg->uid;
-			Fprintf( svars->jfp, "%c %d\n", ")("[t], tmsg->uid );
+			/* In bulk mode, this is recorded by commit_pending(). */
+			if (!(svars->bulk && t == S))
+				Fprintf( svars->jfp, "%c %d\n", ")("[t], tmsg->uid );
 		}
 	}
 }
@@ -1344,11 +2529,14 @@ msgs_copied( sync_vars_t *svars, int t )
 	if (!(svars->state[t] & ST_SENT_NEW) || svars->new_done[t] < svars->new_total[t])
 		return 0;
 
+	phase_end( svars, PH_COPY );
+	if (commit_pending( svars, t ))
+		return 1;
 	debug( "finding just copied messages on %s\n", str_ms[t] );
 	for (srec = svars->srecs; srec; srec = srec->next) {
 		if (srec->status & S_DEAD)
 			continue;
-		if (srec->tuid[0] && srec->uid[t] == -2) {
+		if (srec->tuid && srec->uid[t] == -2) {
 			debug( "  pair(%d,%d): lookup %s, TUID %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], str_ms[t], srec->tuid );
 			svars->find_new_total[t]++;
 			stats( svars );
@@ -1382,7 +2570,7 @@ msg_found_new( int sts, int uid, void *aux )
 	}
 	Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], vars->srec->uid[M], vars->srec->uid[S], uid );
 	vars->srec->uid[t] = uid;
-	vars->srec->tuid[0] = 0;
+	vars->srec->tuid = 0;
 	free( vars );
 	svars->find_new_done[t]++;
 	stats( svars );
@@ -1472,6 +2660,8 @@ msgs_flags_set( sync_vars_t *svars, int t )
 	if (!(svars->state[t] & ST_SENT_FLAGS) || svars->flags_done[t] < svars->flags_total[t])
 		return 0;
 
+	phase_end( svars, PH_FLAGS );
+	phase_begin( svars, PH_TRASH );
 	if ((svars->chan->ops[t] & OP_EXPUNGE) &&
 	    (svars->ctx[t]->conf->trash || (svars->ctx[1-t]->conf->trash && svars->ctx[1-t]->conf->trash_remote_new))) {
 		debug( "trashing in %s\n", str_ms[t] );
@@ -1482,7 +2672,13 @@ msgs_flags_set( sync_vars_t *svars, int t )
 						debug( "%s: trashing message %d\n", str_ms[t], tmsg->uid );
 						svars->trash_total[t]++;
 						stats( svars );
-						if (svars->drv[t]->trash_msg( svars->ctx[t], tmsg, msg_trashed, AUX ))
+						jflush( svars );
+						if (DFlags & DRYRUN) {
+							svars->plan[t].ntrash++;
+							plan_rtts( svars, t, 1 );
+							if (msg_trashed( DRV_OK, AUX ))
+								return 1;
+						} else if (svars->drv[t]->trash_msg( svars->ctx[t], tmsg, msg_trashed, AUX ))
 							return 1;
 					} else
 						debug( "%s: not trashing message %d - not new\n", str_ms[t], tmsg->uid );
@@ -1497,7 +2693,13 @@ msgs_flags_set( sync_vars_t *svars, int t )
 							cv->aux = AUX;
 							cv->srec = 0;
 							cv->msg = tmsg;
-							if (copy_msg( cv ))
+							if (DFlags & DRYRUN) {
+								svars->plan[t].ntrash++;
+								plan_rtts( svars, t, 1 );
+								plan_rtts( svars, 1-t, 1 );
+								if (msg_rtrashed( SYNC_OK, 0, cv ))
+									return 1;
+							} else if (copy_msg( cv ))
 								return 1;
 						} else
 							debug( "%s: not remote trashing message %d - too big\n", str_ms[t], tmsg->uid );
@@ -1549,16 +2751,58 @@ msg_rtrashed( int sts, int uid, copy_vars_t *vars )
 static int box_closed( int sts, void *aux );
 static void box_closed_p2( sync_vars_t *svars, int t );
 
+static void
+record_stats( sync_vars_t *svars )
+{
+	static const char *const phases[PH_COUNT] = {
+		"select", "list", "match", "copy", "flags", "trash", "close", "state"
+	};
+	char *chan, *box[2];
+	double ct;
+	int ph, bl;
+	char buf[PH_COUNT * 32];
+
+	if (!global_stats_file)
+		return;
+	for (bl = ph = 0; ph < PH_COUNT; ph++)
+		bl += nfsnprintf( buf + bl, sizeof(buf) - bl, "%s\"%s\":%.6f", ph ? "," : "", phases[ph], svars->ptime[ph] );
+	chan = json_quote( svars->chan->name );
+	box[M] = json_quote( svars->ctx[M]->name );
+	box[S] = json_quote( svars->ctx[S]->name );
+	ct = svars->ptime[PH_COPY];
+	stats_record( "{\"type\":\"box\",\"time\":%ld,\"channel\":%s,\"master\":%s,\"slave\":%s,"
+	              "\"phases\":{%s},\"messages\":{\"push\":%d,\"pull\":%d},\"bytes\":{\"push\":%lu,\"pull\":%lu},"
+	              "\"msgs_per_sec\":%.1f,\"bytes_per_sec\":%.0f}\n",
+	              (long)time( 0 ), chan, box[M], box[S], buf,
+	              svars->new_done[M], svars->new_done[S], svars->bytes[M], svars->bytes[S],
+	              ct > 0 ? (svars->new_done[M] + svars->new_done[S]) / ct : 0.,
+	              ct > 0 ? (svars->bytes[M] + svars->bytes[S]) / ct : 0. );
+	free( box[S] );
+	free( box[M] );
+	free( chan );
+}
+
 static int
 sync_close( sync_vars_t *svars, int t )
 {
+	message_t *tmsg;
 	if ((~svars->state[t] & (ST_SENT_FIND_NEW|ST_SENT_TRASH)) ||
 	    svars->find_new_done[t] < svars->find_new_total[t] ||
 	    svars->trash_done[t] < svars->trash_total[t])
 		return 0;
 
+	phase_end( svars, PH_TRASH );
 	if ((svars->chan->ops[t] & OP_EXPUNGE) /*&& !(svars->state[t] & ST_TRASH_BAD)*/) {
 		debug( "expunging %s\n", str_ms[t] );
+		phase_begin( svars, PH_CLOSE );
+		jflush( svars );
+		if (DFlags & DRYRUN) {
+			for (tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next)
+				if (!(tmsg->status & M_DEAD) && (tmsg->flags & F_DELETED))
+					svars->plan[t].nexp++;
+			plan_rtts( svars, t, 1 );
+			return box_closed( DRV_OK, AUX );
+		}
 		return svars->drv[t]->close( svars->ctx[t], box_closed, AUX );
 	}
 	box_closed_p2( svars, t );
@@ -1573,6 +2817,7 @@ box_closed( int sts, void *aux )
 	if (check_ret( sts, svars, t ))
 		return 1;
 	svars->state[t] |= ST_DID_EXPUNGE;
+	phase_end( svars, PH_CLOSE );
 	box_closed_p2( svars, t );
 	return 0;
 }
@@ -1581,6 +2826,7 @@ static void
 box_closed_p2( sync_vars_t *svars, int t )
 {
 	sync_rec_t *srec;
+	struct stat st;
 	int minwuid;
 	char fbuf[16]; /* enlarge when support for keywords is added */
 
@@ -1588,6 +2834,13 @@ box_closed_p2( sync_vars_t *svars, int t )
 	if (!(svars->state[1-t] & ST_CLOSED))
 		return;
 
+	if (DFlags & DRYRUN) {
+		print_plan( svars );
+		Fclose( svars->jfp );
+		sync_bail( svars );
+		return;
+	}
+
 	if ((svars->state[M] | svars->state[S]) & ST_DID_EXPUNGE) {
 		/* This cleanup is not strictly necessary, as the next full sync
 		   would throw out the dead entries anyway. But ... */
@@ -1628,22 +2881,65 @@ box_closed_p2( sync_vars_t *svars, int t )
 		}
 	}
 
-	Fprintf( svars->nfp, "%d:%d %d:%d:%d\n", svars->uidval[M], svars->maxuid[M], svars->uidval[S], svars->smaxxuid, svars->maxuid[S] );
-	for (srec = svars->srecs; srec; srec = srec->next) {
-		if (srec->status & S_DEAD)
-			continue;
-		make_flags( srec->flags, fbuf );
-		Fprintf( svars->nfp, "%d %d %s%s\n", srec->uid[M], srec->uid[S],
-		         srec->status & S_EXPIRED ? "X" : "", fbuf );
+	if (svars->window && svars->wdone != 3) {
+		jflush( svars );
+		run_windows( svars );
+		return;
+	}
+
+	/* In log mode, the state is rewritten only once the log has grown
+	   too big relative to it. */
+	phase_begin( svars, PH_STATE );
+	if (svars->logmode) {
+		/* Flush first, so the size covers everything logged. */
+		jflush( svars );
+		if (svars->bino && !(DFlags & KEEPJOURNAL) && !fstat( fileno( svars->jfp ), &st ) &&
+		    st.st_size * 100 <= svars->bsize * global_state_log)
+		{
+			Fclose( svars->jfp );
+			phase_end( svars, PH_STATE );
+			record_stats( svars );
+			sync_bail( svars );
+			return;
+		}
+		debug( "compacting sync state\n" );
+		if (!(svars->nfp = fopen( svars->nname, "w" ))) {
+			error( "Error: cannot write new sync state %s\n", svars->nname );
+			Fclose( svars->jfp );
+			svars->ret = SYNC_FAIL;
+			sync_bail( svars );
+			return;
+		}
+	}
+	if (global_state_format == STATE_BINARY)
+		write_state_binary( svars );
+	else {
+		Fprintf( svars->nfp, "%d:%d %d:%d:%d\n", svars->uidval[M], svars->maxuid[M], svars->uidval[S], svars->smaxxuid, svars->maxuid[S] );
+		for (srec = svars->srecs; srec; srec = srec->next) {
+			if (srec->status & S_DEAD)
+				continue;
+			make_flags( srec->flags, fbuf );
+			Fprintf( svars->nfp, "%d %d %s%s\n", srec->uid[M], srec->uid[S],
+			         srec->status & S_EXPIRED ? "X" : "", fbuf );
+		}
 	}
 
+	if (global_state_fsync && (fflush( svars->nfp ) == EOF || fsync( fileno( svars->nfp ) ))) {
+		perror( "cannot write file" );
+		exit( 1 );
+	}
 	Fclose( svars->nfp );
 	Fclose( svars->jfp );
 	if (!(DFlags & KEEPJOURNAL)) {
 		/* order is important! */
 		rename( svars->nname, svars->dname );
-		unlink( svars->jname );
+		if (!svars->logmode)
+			unlink( svars->jname );
+		if (svars->logmode || svars->logged)
+			unlink( svars->logname );
 	}
+	phase_end( svars, PH_STATE );
+	record_stats( svars );
 
 	sync_bail( svars );
 }
@@ -1651,20 +2947,32 @@ box_closed_p2( sync_vars_t *svars, int t )
 static void
 sync_bail( sync_vars_t *svars )
 {
-	sync_rec_t *srec, *nsrec;
+	srec_chunk_t *sc, *nsc;
+	tuid_chunk_t *tc, *ntc;
+	copy_vars_t *cv, *ncv;
 
-	for (srec = svars->srecs; srec; srec = nsrec) {
-		nsrec = srec->next;
-		free( srec );
+	for (cv = svars->copyq; cv; cv = ncv) {
+		ncv = cv->next;
+		free( cv );
+	}
+	for (sc = svars->schunks; sc; sc = nsc) {
+		nsc = sc->next;
+		free( sc );
 	}
-	unlink( svars->lname );
+	for (tc = svars->tchunks; tc; tc = ntc) {
+		ntc = tc->next;
+		free( tc );
+	}
+	if (svars->lfd >= 0)
+		unlink( svars->lname );
 	sync_bail1( svars );
 }
 
 static void
 sync_bail1( sync_vars_t *svars )
 {
-	close( svars->lfd );
+	if (svars->lfd >= 0)
+		close( svars->lfd );
 	sync_bail2( svars );
 }
 
@@ -1675,6 +2983,12 @@ sync_bail2( sync_vars_t *svars )
 	void *aux = svars->aux;
 	int ret = svars->ret;
 
+	if (svars->wnext)
+		*svars->wnext = -1;
+
+	free( svars->pend[M] );
+	free( svars->pend[S] );
+	free( svars->logname );
 	free( svars->lname );
 	free( svars->nname );
 	free( svars->jname );
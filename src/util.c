@@ -29,8 +29,10 @@
 #include <string.h>
 #include <pwd.h>
 #include <ctype.h>
+#include <sys/time.h>
 
 int DFlags, Ontty;
+volatile sig_atomic_t StatsDump;
 static int need_nl;
 
 void
@@ -174,15 +176,102 @@ free_string_list( string_list_t *list )
 	}
 }
 
+/* Messages are carved out of blocks, so a listing ends up mostly
+   contiguous in memory. The drivers reserve the whole lot up front
+   when they know how many messages are coming. */
+#define MSG_BLOCK 256
+
 void
-free_generic_messages( message_t *msgs )
+reserve_messages( store_t *ctx, int size, int count )
 {
-	message_t *tmsg;
+	msg_block_t *blk;
+
+	if ((blk = ctx->msgblocks) && blk->alloc - blk->used >= count)
+		return;
+	blk = nfmalloc( sizeof(*blk) + count * size );
+	blk->size = size;
+	blk->used = 0;
+	blk->alloc = count;
+	blk->next = ctx->msgblocks;
+	ctx->msgblocks = blk;
+}
+
+/* Return a zeroed message and append it to ctx->msgs. */
+message_t *
+new_message( store_t *ctx, int size )
+{
+	msg_block_t *blk;
+	message_t *msg, **msgapp;
+
+	if (!(blk = ctx->msgblocks) || blk->used == blk->alloc)
+		reserve_messages( ctx, size, MSG_BLOCK );
+	blk = ctx->msgblocks;
+	msg = block_msg( blk, blk->used++ );
+	memset( msg, 0, size );
+	if (!(msgapp = ctx->msgapp))
+		for (msgapp = &ctx->msgs; *msgapp; msgapp = &(*msgapp)->next);
+	*msgapp = msg;
+	ctx->msgapp = &msg->next;
+	free( ctx->msgidx );
+	ctx->msgidx = 0;
+	return msg;
+}
 
-	for (; msgs; msgs = tmsg) {
-		tmsg = msgs->next;
-		free( msgs );
+/* This covers messages which were unlinked from ctx->msgs as well. */
+void
+free_generic_messages( store_t *ctx )
+{
+	msg_block_t *blk, *nblk;
+	int i;
+
+	for (blk = ctx->msgblocks; blk; blk = nblk) {
+		nblk = blk->next;
+		for (i = 0; i < blk->used; i++)
+			free( block_msg( blk, i )->msgid );
+		free( blk );
 	}
+	free( ctx->msgidx );
+	ctx->msgs = 0;
+	ctx->msgapp = 0;
+	ctx->msgblocks = 0;
+	ctx->msgidx = 0;
+}
+
+static int
+compare_msg_uids( const void *a, const void *b )
+{
+	return (*(const message_t * const *)a)->uid - (*(const message_t * const *)b)->uid;
+}
+
+/* Binary search by UID. The index is built on first use after the
+   listing changed; it is a plain copy of the list when the driver
+   delivered the messages in order, which is the common case. */
+message_t *
+find_uid_msg( store_t *ctx, int uid )
+{
+	message_t *msg;
+	int l, r, m, sorted;
+
+	if (!ctx->msgidx) {
+		for (ctx->nmsgidx = 0, msg = ctx->msgs; msg; msg = msg->next)
+			ctx->nmsgidx++;
+		ctx->msgidx = nfmalloc( (ctx->nmsgidx + 1) * sizeof(*ctx->msgidx) );
+		for (l = 0, sorted = 1, msg = ctx->msgs; msg; msg = msg->next) {
+			if (l && ctx->msgidx[l - 1]->uid > msg->uid)
+				sorted = 0;
+			ctx->msgidx[l++] = msg;
+		}
+		if (!sorted)
+			qsort( ctx->msgidx, ctx->nmsgidx, sizeof(*ctx->msgidx), compare_msg_uids );
+	}
+	for (l = 0, r = ctx->nmsgidx; l < r; ) {
+		m = (l + r) / 2;
+		if (ctx->msgidx[m]->uid < uid)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l < ctx->nmsgidx && ctx->msgidx[l]->uid == uid ? ctx->msgidx[l] : 0;
 }
 
 #ifndef HAVE_VASPRINTF
@@ -351,6 +440,190 @@ expand_strdup( const char *s )
 		return nfstrdup( s );
 }
 
+/* Extract the ID from the Message-ID header within the first len bytes of
+ * hdr, which needn't to be the complete header. */
+char *
+get_msgid( const char *hdr, int len )
+{
+	const char *p, *s, *e = hdr + len;
+
+	for (p = hdr; p < e && *p != '\n' && *p != '\r'; p++) {
+		if (e - p > 11 && !strncasecmp( p, "Message-ID:", 11 )) {
+			for (p += 11; p < e; p++) {
+				if (*p == '\n' && (p + 1 == e || (p[1] != ' ' && p[1] != '\t')))
+					return 0;
+				if (!isspace( (unsigned char)*p ))
+					break;
+			}
+			for (s = p; p < e && !isspace( (unsigned char)*p ); p++);
+			return p > s ? my_strndup( s, p - s ) : 0;
+		}
+		if (!(p = memchr( p, '\n', e - p )))
+			break;
+	}
+	return 0;
+}
+
+/* Read from fd up to and including the empty line which ends the header,
+ * but no more than size bytes; returns the number of bytes read, or -1. */
+int
+read_msg_head( int fd, msg_data_t *data, int size )
+{
+	char *p, *end;
+	int len, chunk;
+
+	data->data = 0;
+	for (len = 0; len < size; ) {
+		chunk = size - len;
+		if (chunk > HEAD_CHUNK)
+			chunk = HEAD_CHUNK;
+		data->size = len + chunk + DATA_SLACK(len + chunk);
+		data->data = nfrealloc( data->data, data->size );
+		if (read( fd, data->data + len, chunk ) != chunk)
+			return -1;
+		p = data->data + (len > 2 ? len - 2 : 0);
+		end = data->data + (len += chunk);
+		for (; (p = memchr( p, '\n', end - p )) && p + 1 < end; p++)
+			if (p[1] == '\n' || (p[1] == '\r' && p + 2 < end && p[2] == '\n'))
+				return len;
+	}
+	return len;
+}
+
+/* Create an anonymous file for message data which is too big to be
+ * kept in memory. */
+int
+spill_file( void )
+{
+	const char *dir;
+	char *path;
+	int fd;
+
+	if (!(dir = getenv( "TMPDIR" )))
+		dir = "/tmp";
+	nfasprintf( &path, "%s/mbsync-spill.XXXXXX", dir );
+	if ((fd = mkstemp( path )) < 0)
+		perror( path );
+	else
+		unlink( path );
+	free( path );
+	return fd;
+}
+
+/* Copy n bytes from src to dst, inserting a CR before each LF (cra) or
+   dropping all CRs (crd); returns the number of bytes written. Without
+   cra, this works in place as long as dst <= src. The scanning is left to
+   memchr(), which is vectorized in any decent libc. */
+int
+conv_copy( char *dst, const char *src, int n, int cra, int crd )
+{
+	const char *p, *e = src + n;
+	char *d = dst;
+	int l;
+
+	if (cra) {
+		for (; (p = memchr( src, '\n', e - src )); src = p + 1) {
+			memcpy( d, src, l = p - src );
+			d += l;
+			*d++ = '\r';
+			*d++ = '\n';
+		}
+	} else if (crd) {
+		for (; (p = memchr( src, '\r', e - src )); src = p + 1) {
+			memmove( d, src, l = p - src );
+			d += l;
+		}
+	}
+	memmove( d, src, e - src );
+	return d + (e - src) - dst;
+}
+
+/* Like conv_copy() with cra, but from buf + from to buf + to, proceeding
+   backwards, so it works in place as long as to >= from. */
+void
+conv_copy_back( char *buf, int from, int n, int to, int nlf )
+{
+	char *s = buf + from, *e = s + n, *d = buf + to + n + nlf;
+#ifdef HAVE_MEMRCHR
+	char *p;
+	int l;
+
+	for (; (p = memrchr( s, '\n', e - s )); e = p) {
+		d -= l = e - p - 1;
+		memmove( d, p + 1, l );
+		*--d = '\n';
+		*--d = '\r';
+	}
+	memmove( d - (e - s), s, e - s );
+#else
+	while (e > s)
+		if ((*--d = *--e) == '\n')
+			*--d = '\r';
+#endif
+}
+
+int
+count_chr( const char *p, int n, char c )
+{
+	const char *e = p + n;
+	int cnt = 0;
+
+	for (; (p = memchr( p, c, e - p )); p++)
+		cnt++;
+	return cnt;
+}
+
+double
+get_time( void )
+{
+	struct timeval tv;
+
+	gettimeofday( &tv, 0 );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Make a JSON string literal out of s. */
+char *
+json_quote( const char *s )
+{
+	char *r, *d;
+
+	d = r = nfmalloc( strlen( s ) * 6 + 3 );
+	*d++ = '"';
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			*d++ = '\\';
+			*d++ = *s;
+		} else if ((unsigned char)*s < 0x20)
+			d += sprintf( d, "\\u%04x", *s );
+		else
+			*d++ = *s;
+	}
+	*d++ = '"';
+	*d = 0;
+	return r;
+}
+
+/* Append a line to the StatsFile, if one is configured. */
+void
+stats_record( const char *fmt, ... )
+{
+	FILE *fp;
+	va_list va;
+
+	if (!global_stats_file)
+		return;
+	if (!(fp = fopen( global_stats_file, "a" ))) {
+		perror( global_stats_file );
+		return;
+	}
+	va_start( va, fmt );
+	vfprintf( fp, fmt, va );
+	va_end( va );
+	if (fclose( fp ) == EOF)
+		perror( global_stats_file );
+}
+
 static int
 compare_ints( const void *l, const void *r )
 {